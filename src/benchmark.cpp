@@ -1,24 +1,52 @@
+#include <map>
+#include <deque>
+#include <future>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
 #include <thread>
+#include <sstream>
 #include <iostream>
+#include <exception>
 #include <algorithm>
+#include <condition_variable>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <pthread.h>
 
+#include <sys/un.h>
+#include <sys/socket.h>
+
 #include <faiss/AutoTune.h>
 #include <faiss/index_io.h>
+#include <faiss/clone_index.h>
+#include <faiss/impl/IDSelector.h>
 
+#include "util/numa.h"
 #include "util/vecs.h"
 #include "util/string.h"
 #include "util/vector.h"
 #include "util/perfmon.h"
 #include "util/statistics.h"
 
+// Besides the exact recall, if <thresholds> (the k1-th true distance of each
+// query) is not nullptr, the tie-aware recall also counts the returned ids
+// whose distances are within <epsilon> (relative) of the threshold, so that
+// vectors tied with the k1-th neighbor are not taken as misses. It is the
+// larger of the two counts, capped at k1. The distances are those returned
+// by the index, which are approximate and often lower for quantized indexes
+// (PQ, SQ), so it is then an upper bound.
 void Evaluate(size_t count, size_t top_k1, size_t top_k2,
         const faiss::idx_t* groundtruths,
-        faiss::idx_t* labels,
-        util::statistics::Percentile<float>& percentile_rate) {
+        faiss::idx_t* labels, const float* distances,
+        const float* thresholds, float epsilon,
+        util::statistics::Percentile<float>& percentile_rate,
+        util::statistics::Percentile<float>& percentile_tie_rate) {
     size_t thread_count = std::thread::hardware_concurrency();
     std::vector<std::thread> threads;
     std::atomic<size_t> cursor(0);
@@ -32,6 +60,18 @@ void Evaluate(size_t count, size_t top_k1, size_t top_k2,
                 }
                 const faiss::idx_t* gs = groundtruths + index * top_k1;
                 faiss::idx_t* ls = labels + index * top_k2;
+                const float* ds = distances + index * top_k2;
+                size_t ties = 0;
+                if (thresholds) {
+                    float threshold = thresholds[index];
+                    threshold += epsilon * std::max(std::abs(threshold),
+                            1.0f);
+                    for (size_t i = 0; i < top_k2; i++) {
+                        if (ls[i] >= 0 && ds[i] <= threshold) {
+                            ties++;
+                        }
+                    }
+                }
                 std::sort(ls, ls + top_k2);
                 size_t ig = 0, il = 0, correct = 0;
                 while (ig < top_k1 && il < top_k2) {
@@ -49,8 +89,13 @@ void Evaluate(size_t count, size_t top_k1, size_t top_k2,
                     }
                 }
                 float rate = (float)correct / top_k1;
+                float tie_rate = (float)std::min(std::max(correct, ties),
+                        top_k1) / top_k1;
                 mutex.lock();
                 percentile_rate.add(rate);
+                if (thresholds) {
+                    percentile_tie_rate.add(tie_rate);
+                }
                 mutex.unlock();
             }
         });
@@ -61,9 +106,43 @@ void Evaluate(size_t count, size_t top_k1, size_t top_k2,
 }
 
 struct TestCase {
+    enum Mode {
+        // <loop> passes over the queries (or passes until <duration>
+        // seconds if <loop> is 0) in batches of <batch_size>, each thread
+        // sending a batch right after the last one returns.
+        STATIC,
+        // Single queries arrive at <rate> per second for <duration>
+        // seconds, as a Poisson process or at a fixed interval.
+        OPEN,
+        FIXED,
+        // <clients> each send a single query right after the last one
+        // returns, for <duration> seconds.
+        CLOSED,
+        // Like STATIC of <duration> seconds in batches of one, while a
+        // writer adds and removes vectors at <add_rate> and <remove_rate>
+        // per second, on a copy of the index.
+        MIXED,
+    };
+
     std::string parameters;
+    Mode mode;
     size_t loop;
     size_t batch_size;
+    double rate;
+    size_t clients;
+    double add_rate;
+    double remove_rate;
+    double duration;
+    // Except for STATIC, the queued queries are searched in batches of up
+    // to <max_batch>, once that many are queued or the oldest one has
+    // waited <max_wait_us>.
+    size_t max_batch;
+    uint64_t max_wait_us;
+    // Before the statistics, <warmup_queries> queries or <warmup_duration>
+    // seconds are searched as a STATIC case of the same threads and batch
+    // size, and excluded. No warmup if both are 0.
+    size_t warmup_queries;
+    double warmup_duration;
     std::vector<int> threads;
 };
 
@@ -88,43 +167,522 @@ void SetCPU(int cpu) {
     }
 }
 
-void Benchmark(const faiss::Index* index, size_t count, size_t top_k1, size_t top_k2,
-        const float* queries, const faiss::idx_t* groundtruths,
-        const TestCase& test_case,
-        float& qps, float& cpu_util, float& mem_r_bw, float& mem_w_bw,
-        util::statistics::Percentile<uint32_t>& percentile_latency,
-        util::statistics::Percentile<float>& percentile_rate) {
-    size_t loop = test_case.loop;
-    if (loop == 0) {
-        throw std::runtime_error ("<loop = 0> is invalid!");
+// Return the arrival times of an open-loop case in nanoseconds from the
+// start. The gaps of a Poisson process are exponentially distributed.
+std::vector<uint64_t> ScheduleArrivals(const TestCase& test_case) {
+    std::vector<uint64_t> arrivals;
+    std::default_random_engine engine;
+    std::exponential_distribution<double> gap(test_case.rate);
+    double time = 0;
+    while (time < test_case.duration) {
+        arrivals.push_back((uint64_t)(time * 1000000000));
+        time += test_case.mode == TestCase::OPEN ? gap(engine) :
+                1.0 / test_case.rate;
+    }
+    return arrivals;
+}
+
+void WaitUntil(uint64_t ns) {
+    uint64_t now_ns;
+    while ((now_ns = util::perfmon::Clock::nanosecond()) < ns) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(ns - now_ns));
+    }
+}
+
+// Coalesce the queries arriving one by one into batches, like a serving
+// layer does.
+class Batcher {
+
+public:
+    struct Request {
+        // The query is the <index> % count one.
+        size_t index;
+        uint64_t arrival_ns;
+    };
+
+private:
+    size_t max_batch;
+    uint64_t max_wait_ns;
+    std::deque<Request> queue;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable cond;
+
+public:
+    Batcher(size_t _max_batch, uint64_t _max_wait_ns) :
+            max_batch(_max_batch), max_wait_ns(_max_wait_ns),
+            closed(false) {}
+
+    void push(const Request& request) {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(request);
+        cond.notify_all();
+    }
+
+    // No more requests will be pushed.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cond.notify_all();
+    }
+
+    // Wait until <max_batch> requests are queued or the oldest one has
+    // waited <max_wait_ns>, and take up to <max_batch> of them. Return false
+    // if closed and nothing is left.
+    bool pop(std::vector<Request>& batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            if (queue.empty()) {
+                if (closed) {
+                    return false;
+                }
+                cond.wait(lock);
+                continue;
+            }
+            if (queue.size() >= max_batch || closed) {
+                break;
+            }
+            uint64_t deadline_ns = queue.front().arrival_ns + max_wait_ns;
+            uint64_t now_ns = util::perfmon::Clock::nanosecond();
+            if (now_ns >= deadline_ns) {
+                break;
+            }
+            cond.wait_for(lock, std::chrono::nanoseconds(deadline_ns -
+                    now_ns));
+        }
+        size_t n = std::min(max_batch, queue.size());
+        batch.assign(queue.begin(), queue.begin() + n);
+        queue.erase(queue.begin(), queue.begin() + n);
+        return true;
+    }
+
+};
+
+// A lock of readers and writers, preferring the writers so that a stream of
+// searches can not starve the updates.
+class RWLock {
+
+private:
+    pthread_rwlock_t rwlock;
+
+public:
+    RWLock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr,
+                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    RWLock(const RWLock&) = delete;
+
+    RWLock& operator =(const RWLock&) = delete;
+
+    ~RWLock() {
+        pthread_rwlock_destroy(&rwlock);
+    }
+
+    void lockShared() {
+        pthread_rwlock_rdlock(&rwlock);
+    }
+
+    void lock() {
+        pthread_rwlock_wrlock(&rwlock);
+    }
+
+    void unlock() {
+        pthread_rwlock_unlock(&rwlock);
+    }
+
+};
+
+// The writes of MIXED cases: the held-out vectors to add, with ids following
+// those of the base, and the groundtruth over the base and them (e.g. by
+// groundtruth --update <old> --base-offset <base count>). While vectors are
+// added and removed, the groundtruth of a query is its first <top_n>
+// neighbors still in the index, so the groundtruth should be deeper than
+// <top_n> by the removes.
+class Updates {
+
+private:
+    std::shared_ptr<float> vectors;
+    size_t vector_count;
+    size_t dim;
+    std::shared_ptr<faiss::idx_t> rankings;
+    size_t columns;
+    size_t base_count;
+    size_t added;
+    size_t removed;
+    std::vector<bool> alive;
+    std::default_random_engine engine;
+
+public:
+    Updates(std::shared_ptr<float> _vectors, size_t _vector_count,
+            size_t _dim, std::shared_ptr<faiss::idx_t> _rankings,
+            size_t _columns) : vectors(_vectors),
+            vector_count(_vector_count), dim(_dim), rankings(_rankings),
+            columns(_columns), base_count(0), added(0), removed(0) {}
+
+    // Start over from an index of <_base_count> vectors of ids from 0.
+    void reset(size_t _base_count) {
+        base_count = _base_count;
+        added = 0;
+        removed = 0;
+        alive.assign(base_count + vector_count, false);
+        std::fill(alive.begin(), alive.begin() + base_count, true);
+        engine.seed();
+    }
+
+    // Add the next held-out vector. Return false if none is left.
+    bool add(faiss::Index* index) {
+        if (added >= vector_count) {
+            return false;
+        }
+        faiss::idx_t id = base_count + added;
+        index->add_with_ids(1, vectors.get() + added * dim, &id);
+        alive[id] = true;
+        added++;
+        return true;
+    }
+
+    // Remove a random vector of the base. Return false if none is left.
+    bool remove(faiss::Index* index) {
+        if (removed >= base_count) {
+            return false;
+        }
+        std::uniform_int_distribution<size_t> uniform(0, base_count - 1);
+        size_t id;
+        while (!alive[id = uniform(engine)]);
+        index->remove_ids(faiss::IDSelectorRange(id, id + 1));
+        alive[id] = false;
+        removed++;
+        return true;
+    }
+
+    size_t writes() const {
+        return added + removed;
+    }
+
+    // The groundtruths of the first <count> queries at present, in the form
+    // of PrepareGroundTruths().
+    std::vector<faiss::idx_t> groundtruths(size_t count,
+            size_t top_n) const {
+        std::vector<faiss::idx_t> gts(count * top_n);
+        for (size_t i = 0; i < count; i++) {
+            const faiss::idx_t* ranking = rankings.get() + i * columns;
+            faiss::idx_t* gt = gts.data() + i * top_n;
+            size_t n = 0;
+            for (size_t j = 0; j < columns && n < top_n; j++) {
+                if (ranking[j] < 0 || (size_t)ranking[j] >= alive.size()) {
+                    throw std::runtime_error("the groundtruth of --writes "
+                            "has ids beyond the base and the vectors!");
+                }
+                if (alive[ranking[j]]) {
+                    gt[n++] = ranking[j];
+                }
+            }
+            if (n < top_n) {
+                throw std::runtime_error("the groundtruth of --writes is "
+                        "not deep enough for the removes!");
+            }
+            std::sort(gt, gt + top_n);
+        }
+        return gts;
+    }
+
+};
+
+// Add and remove vectors at the rates of a MIXED case from <start_ns> until
+// <end_ns>, each with <lock> held exclusively.
+void RunWriter(faiss::Index* index, Updates& updates, RWLock& lock,
+        const TestCase& test_case, uint64_t start_ns, uint64_t end_ns) {
+    double rates[] = {test_case.add_rate, test_case.remove_rate};
+    size_t done[] = {0, 0};
+    while (true) {
+        uint64_t next_ns[2];
+        for (int i = 0; i < 2; i++) {
+            next_ns[i] = rates[i] > 0 ? start_ns +
+                    (uint64_t)(1000000000.0 * done[i] / rates[i]) : UINT64_MAX;
+        }
+        int i = next_ns[0] <= next_ns[1] ? 0 : 1;
+        if (next_ns[i] >= end_ns) {
+            break;
+        }
+        WaitUntil(next_ns[i]);
+        lock.lock();
+        bool ok;
+        try {
+            ok = i == 0 ? updates.add(index) : updates.remove(index);
+        }
+        catch (...) {
+            lock.unlock();
+            throw;
+        }
+        lock.unlock();
+        // Nothing is left to add or remove.
+        if (!ok) {
+            rates[i] = 0;
+        }
+        done[i]++;
+    }
+}
+
+// Every <period_ms> of a case, write the qps, latencies, cpu utilization and
+// memory bandwidths of the last interval as a line of CSV, or of JSON if the
+// file ends with ".json". The threads of the case record the latencies into
+// SharedHistograms of their own, so that they never wait for the reporter.
+class IntervalReporter {
+
+private:
+    std::unique_ptr<FILE, int (*)(FILE*)> file;
+    bool json;
+    uint64_t period_ns;
+    std::vector<std::unique_ptr<util::statistics::SharedHistogram>>
+            histograms;
+    util::perfmon::MemoryBandwidth* mem_mon;
+    size_t case_index;
+    uint64_t start_ns;
+    bool stopped;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+
+public:
+    IntervalReporter(const char* fpath, uint64_t period_ms) :
+            file(fopen(fpath, "w"), fclose), period_ns(period_ms * 1000000),
+            mem_mon(nullptr), case_index(0), start_ns(0), stopped(true) {
+        if (!file) {
+            throw std::runtime_error(std::string("failed to open '")
+                    .append(fpath).append("'!"));
+        }
+        if (period_ms == 0) {
+            throw std::runtime_error("<interval = 0> is invalid!");
+        }
+        size_t len = strlen(fpath);
+        json = len >= 5 && strcmp(fpath + len - 5, ".json") == 0;
+        if (!json) {
+            fprintf(file.get(), "case,time-ms,qps,latency-p50,latency-p99,"
+                    "latency-max,cpu-util,mem-r-bw,mem-w-bw\n");
+        }
+    }
+
+    IntervalReporter(const IntervalReporter&) = delete;
+
+    IntervalReporter& operator =(const IntervalReporter&) = delete;
+
+    ~IntervalReporter() {
+        if (!stopped) {
+            stop();
+        }
+    }
+
+    // Start reporting the <case_index>-th case of <thread_count> threads.
+    void start(size_t _case_index, size_t thread_count,
+            util::perfmon::MemoryBandwidth* _mem_mon) {
+        histograms.clear();
+        for (size_t i = 0; i < thread_count; i++) {
+            histograms.emplace_back(new util::statistics::SharedHistogram());
+        }
+        case_index = _case_index;
+        mem_mon = _mem_mon;
+        start_ns = util::perfmon::Clock::nanosecond();
+        stopped = false;
+        thread = std::thread([this] {
+            report();
+        });
+    }
+
+    util::statistics::SharedHistogram* histogram(size_t t) {
+        return histograms[t].get();
     }
-    size_t vcount = loop * count;
-    size_t batch_size = test_case.batch_size;
+
+    // Write the last interval if it is at least half as long, and stop.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+            cond.notify_all();
+        }
+        thread.join();
+    }
+
+private:
+    void report() {
+        util::perfmon::CPUUtilization cpu_mon(true, true);
+        cpu_mon.start();
+        uint64_t last_ns = start_ns;
+        uint64_t next_ns = start_ns + period_ns;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            uint64_t now_ns = util::perfmon::Clock::nanosecond();
+            if (!stopped && now_ns < next_ns) {
+                cond.wait_for(lock, std::chrono::nanoseconds(next_ns -
+                        now_ns));
+                continue;
+            }
+            if (stopped && (now_ns - last_ns) * 2 < period_ns) {
+                break;
+            }
+            util::statistics::Histogram window;
+            for (auto it = histograms.begin(); it != histograms.end(); it++) {
+                (*it)->take(window);
+            }
+            float cpu_util = cpu_mon.end();
+            cpu_mon.start();
+            float mem_r_bw, mem_w_bw;
+            mem_mon->glance(mem_r_bw, mem_w_bw);
+            bool empty = window.count() == 0;
+            double values[] = {
+                1000000000.0 * window.count() / (now_ns - last_ns),
+                empty ? NAN : window(50) * 0.001,
+                empty ? NAN : window(99) * 0.001,
+                empty ? NAN : window.worst() * 0.001,
+                cpu_util,
+                mem_r_bw,
+                mem_w_bw,
+            };
+            write((now_ns - start_ns) / 1000000, values);
+            if (stopped) {
+                break;
+            }
+            last_ns = now_ns;
+            next_ns += period_ns;
+        }
+    }
+
+    // Latencies are in microseconds. Unknown values are left empty in CSV,
+    // or null in JSON.
+    void write(uint64_t time_ms, const double (&values)[7]) {
+        static const char* names[] = {"qps", "latency-p50", "latency-p99",
+                "latency-max", "cpu-util", "mem-r-bw", "mem-w-bw"};
+        if (json) {
+            fprintf(file.get(), "{\"case\": %lu, \"time-ms\": %lu",
+                    case_index, time_ms);
+        }
+        else {
+            fprintf(file.get(), "%lu,%lu", case_index, time_ms);
+        }
+        for (size_t i = 0; i < sizeof(values) / sizeof(double); i++) {
+            char buf[256];
+            if (std::isnan(values[i])) {
+                strcpy(buf, json ? "null" : "");
+            }
+            else {
+                sprintf(buf, "%g", values[i]);
+            }
+            if (json) {
+                fprintf(file.get(), ", \"%s\": %s", names[i], buf);
+            }
+            else {
+                fprintf(file.get(), ",%s", buf);
+            }
+        }
+        fprintf(file.get(), json ? "}\n" : "\n");
+        fflush(file.get());
+    }
+
+};
+
+// Report a case by <reporter> (if not nullptr) until stop() or the end of
+// the scope, so that it stops before the monitors it samples are destroyed
+// even if the case fails.
+class ScopedReport {
+
+private:
+    IntervalReporter* reporter;
+
+public:
+    ScopedReport(IntervalReporter* _reporter, size_t case_index,
+            size_t thread_count, util::perfmon::MemoryBandwidth* mem_mon) :
+            reporter(_reporter) {
+        if (reporter) {
+            reporter->start(case_index, thread_count, mem_mon);
+        }
+    }
+
+    ScopedReport(const ScopedReport&) = delete;
+
+    ScopedReport& operator =(const ScopedReport&) = delete;
+
+    ~ScopedReport() {
+        try {
+            stop();
+        }
+        catch (const std::exception& e) {
+        }
+    }
+
+    void stop() {
+        if (reporter) {
+            IntervalReporter* stopping = reporter;
+            reporter = nullptr;
+            stopping->stop();
+        }
+    }
+
+};
+
+// Bind the <t>-th thread of a case, and return the index it searches.
+// <indexes> holds an index for each of <nodes>, or only one if <nodes> is
+// empty. A thread bound to a node searches the index of the node.
+const faiss::Index* PrepareThread(
+        const std::vector<const faiss::Index*>& indexes,
+        const std::vector<util::numa::Node>& nodes, size_t t,
+        size_t thread_count, int cpu) {
+    SetCPU(cpu);
+    size_t node = 0;
+    if (!nodes.empty()) {
+        if (cpu >= 0) {
+            node = util::numa::FindNode(nodes, cpu);
+        }
+        else {
+            node = t * nodes.size() / thread_count;
+            util::numa::Bind(nodes[node]);
+        }
+    }
+    return indexes[node];
+}
+
+// Run a STATIC case of <vcount> queries in batches of <batch_size>, stopping
+// early after <duration> seconds unless it is 0. Every query of a batch gets
+// the latency of the batch. Each thread records the latencies in
+// nanoseconds into a histogram of its own, merged into <latencies> at the
+// end, and also into its histogram of <reporter> unless it is nullptr.
+// Unless <counters> is nullptr, the HardwareCounters of the threads are
+// added to it. Unless <lock> is nullptr, each search holds it shared.
+// Return the count of queries searched.
+size_t RunStatic(const std::vector<const faiss::Index*>& indexes,
+        const std::vector<util::numa::Node>& nodes, size_t count,
+        size_t top_k2, const float* queries, const TestCase& test_case,
+        size_t batch_size, size_t vcount, double duration,
+        IntervalReporter* reporter, double* counters, RWLock* lock,
+        faiss::idx_t* labels, float* distances,
+        util::statistics::Histogram& latencies) {
     if (batch_size == 0) {
         throw std::runtime_error("<batch_size = 0> is invalid!");
     }
     size_t thread_count = test_case.threads.size();
-    if (thread_count == 0) {
-        throw std::runtime_error("<thread_count = 0> is invalid!");
-    }
-    size_t dim = index->d;
-    std::unique_ptr<uint32_t> latencies(NewZeroOutArray<uint32_t>(vcount));
-    std::unique_ptr<faiss::idx_t> labels(
-            NewZeroOutArray<faiss::idx_t>(count * top_k2));
+    size_t dim = indexes[0]->d;
+    uint64_t end_ns = util::perfmon::Clock::nanosecond() +
+            (uint64_t)(duration * 1000000000);
     std::atomic<size_t> cursor(0);
+    std::mutex mutex;
     std::vector<std::thread> threads;
-    util::perfmon::CPUUtilization cpu_mon(true, true);
-    util::perfmon::MemoryBandwidth mem_mon;
-    cpu_mon.start();
-    mem_mon.start();
-    uint64_t all_start_us = util::perfmon::Clock::microsecond();
     for (size_t t = 0; t < thread_count; t++) {
         int cpu = test_case.threads[t];
         SetCPU(cpu);
-        threads.emplace_back([&](int cpu) {
-            SetCPU(cpu);
-            std::unique_ptr<float> distances(
-                    NewZeroOutArray<float>(batch_size * top_k2));
+        threads.emplace_back([&](size_t t, int cpu) {
+            const faiss::Index* index = PrepareThread(indexes, nodes, t,
+                    thread_count, cpu);
+            util::statistics::Histogram lats;
+            util::statistics::SharedHistogram* shared = reporter ?
+                    reporter->histogram(t) : nullptr;
+            std::unique_ptr<util::perfmon::HardwareCounters> hw(counters ?
+                    new util::perfmon::HardwareCounters() : nullptr);
+            if (hw) {
+                hw->start();
+            }
             while (true) {
                 size_t voffset = cursor.fetch_add(batch_size);
                 if (voffset >= vcount) {
@@ -135,35 +693,310 @@ void Benchmark(const faiss::Index* index, size_t count, size_t top_k1, size_t to
                 size_t nquery2 = batch_size - nquery1;
                 const float* queries1 = queries + offset * dim;
                 const float* queries2 = queries;
-                faiss::idx_t* labels1 = labels.get() + offset * top_k2;
-                faiss::idx_t* labels2 = labels.get();
-                float* ds = distances.get();
-                uint64_t start_us = util::perfmon::Clock::microsecond();
-                index->search(nquery1, queries1, top_k2, ds, labels1);
+                faiss::idx_t* labels1 = labels + offset * top_k2;
+                faiss::idx_t* labels2 = labels;
+                float* distances1 = distances + offset * top_k2;
+                float* distances2 = distances;
+                uint64_t start_ns = util::perfmon::Clock::nanosecond();
+                if (lock) {
+                    lock->lockShared();
+                }
+                index->search(nquery1, queries1, top_k2, distances1, labels1);
                 if (nquery2) {
-                    index->search(nquery2, queries2, top_k2, ds, labels2);
+                    index->search(nquery2, queries2, top_k2, distances2,
+                            labels2);
+                }
+                if (lock) {
+                    lock->unlock();
                 }
-                uint64_t end_us = util::perfmon::Clock::microsecond();
-                uint64_t latency = end_us - start_us;
-                uint32_t* lats = latencies.get();
-                size_t lat_end = std::min(vcount, voffset + batch_size);
-                for (size_t i = voffset; i < lat_end; i++) {
-                    lats[i] = (uint32_t)latency;
+                uint64_t done_ns = util::perfmon::Clock::nanosecond();
+                size_t n = std::min(vcount, voffset + batch_size) - voffset;
+                lats.add(done_ns - start_ns, n);
+                if (shared) {
+                    shared->add(done_ns - start_ns, n);
                 }
+                if (duration > 0 && done_ns >= end_ns) {
+                    break;
+                }
+            }
+            double values[util::perfmon::HardwareCounters::EVENT_COUNT];
+            if (hw) {
+                hw->end(values);
             }
-        }, cpu);
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.merge(lats);
+            for (size_t i = 0; hw && i < sizeof(values) / sizeof(double);
+                    i++) {
+                counters[i] += values[i];
+            }
+        }, t, cpu);
     }
     for (size_t t = 0; t < thread_count; t++) {
         threads[t].join();
     }
-    uint64_t all_end_us = util::perfmon::Clock::microsecond();
-    cpu_util = cpu_mon.end();
-    mem_mon.end(mem_r_bw, mem_w_bw);
-    threads.clear();
-    qps = 1000000.0f * vcount / (all_end_us - all_start_us);
-    percentile_latency.add(latencies.get(), vcount);
-    latencies.reset();
-    Evaluate(count, top_k1, top_k2, groundtruths, labels.get(), percentile_rate);
+    return latencies.count();
+}
+
+// Run an OPEN, FIXED or CLOSED case, where single queries go through a
+// Batcher. The latency of a query is measured from its arrival rather than
+// from when it is searched, so that queueing and batching show up in it,
+// and a backlog can not lower the offered load of an open-loop case. The
+// latencies and counters are recorded as in RunStatic(). Return the count
+// of queries searched.
+size_t RunDynamic(const std::vector<const faiss::Index*>& indexes,
+        const std::vector<util::numa::Node>& nodes, size_t count,
+        size_t top_k2, const float* queries, const TestCase& test_case,
+        IntervalReporter* reporter, double* counters, faiss::idx_t* labels,
+        float* distances, util::statistics::Histogram& latencies) {
+    size_t max_batch = test_case.max_batch;
+    if (max_batch == 0) {
+        throw std::runtime_error("<max_batch = 0> is invalid!");
+    }
+    size_t thread_count = test_case.threads.size();
+    size_t dim = indexes[0]->d;
+    Batcher batcher(max_batch, test_case.max_wait_us * 1000);
+    std::mutex mutex;
+    std::vector<std::thread> threads;
+    uint64_t start_ns = util::perfmon::Clock::nanosecond();
+    uint64_t end_ns = start_ns +
+            (uint64_t)(test_case.duration * 1000000000);
+    std::atomic<size_t> issued(0);
+    std::atomic<size_t> clients(test_case.clients);
+    if (test_case.mode == TestCase::CLOSED) {
+        if (test_case.clients == 0) {
+            throw std::runtime_error("<clients = 0> is invalid!");
+        }
+        for (size_t i = 0; i < test_case.clients; i++) {
+            batcher.push({issued++, start_ns});
+        }
+    }
+    else {
+        std::vector<uint64_t> arrivals = ScheduleArrivals(test_case);
+        threads.emplace_back([&, arrivals] {
+            for (size_t i = 0; i < arrivals.size(); i++) {
+                uint64_t arrival_ns = start_ns + arrivals[i];
+                WaitUntil(arrival_ns);
+                batcher.push({i, arrival_ns});
+            }
+            batcher.close();
+        });
+    }
+    for (size_t t = 0; t < thread_count; t++) {
+        int cpu = test_case.threads[t];
+        SetCPU(cpu);
+        threads.emplace_back([&](size_t t, int cpu) {
+            const faiss::Index* index = PrepareThread(indexes, nodes, t,
+                    thread_count, cpu);
+            std::vector<Batcher::Request> batch;
+            std::vector<float> xs(max_batch * dim);
+            std::vector<faiss::idx_t> ls(max_batch * top_k2);
+            std::vector<float> ds(max_batch * top_k2);
+            util::statistics::Histogram lats;
+            util::statistics::SharedHistogram* shared = reporter ?
+                    reporter->histogram(t) : nullptr;
+            std::unique_ptr<util::perfmon::HardwareCounters> hw(counters ?
+                    new util::perfmon::HardwareCounters() : nullptr);
+            if (hw) {
+                hw->start();
+            }
+            while (batcher.pop(batch)) {
+                size_t n = batch.size();
+                for (size_t i = 0; i < n; i++) {
+                    memcpy(xs.data() + i * dim, queries +
+                            batch[i].index % count * dim,
+                            sizeof(float) * dim);
+                }
+                index->search(n, xs.data(), top_k2, ds.data(), ls.data());
+                uint64_t done_ns = util::perfmon::Clock::nanosecond();
+                for (size_t i = 0; i < n; i++) {
+                    size_t offset = batch[i].index % count * top_k2;
+                    memcpy(labels + offset, ls.data() + i * top_k2,
+                            sizeof(faiss::idx_t) * top_k2);
+                    memcpy(distances + offset, ds.data() + i * top_k2,
+                            sizeof(float) * top_k2);
+                    lats.add(done_ns - batch[i].arrival_ns);
+                    if (shared) {
+                        shared->add(done_ns - batch[i].arrival_ns);
+                    }
+                    if (test_case.mode != TestCase::CLOSED) {
+                        continue;
+                    }
+                    // The client sends its next query, or leaves after the
+                    // duration.
+                    if (done_ns < end_ns) {
+                        batcher.push({issued++, done_ns});
+                    }
+                    else if (--clients == 0) {
+                        batcher.close();
+                    }
+                }
+            }
+            double values[util::perfmon::HardwareCounters::EVENT_COUNT];
+            if (hw) {
+                hw->end(values);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.merge(lats);
+            for (size_t i = 0; hw && i < sizeof(values) / sizeof(double);
+                    i++) {
+                counters[i] += values[i];
+            }
+        }, t, cpu);
+    }
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+    return latencies.count();
+}
+
+// What the cases run on.
+struct CaseContext {
+    // An index for each of <nodes>, or only one if <nodes> is empty.
+    std::vector<const faiss::Index*> indexes;
+    std::vector<util::numa::Node> nodes;
+    size_t count;
+    size_t top_k1;
+    size_t top_k2;
+    const float* queries;
+    const faiss::idx_t* groundtruths;
+    // The <top_k1>-th distances for the tie-aware recall, or nullptr.
+    const float* thresholds;
+    float epsilon;
+    // Optional, or nullptr.
+    IntervalReporter* reporter;
+    Updates* updates;
+    bool counting;
+};
+
+// The results of a case.
+struct CaseResult {
+    float qps;
+    float write_qps;
+    float cpu_util;
+    float mem_r_bw;
+    float mem_w_bw;
+    // Only if CaseContext::counting.
+    double counters[util::perfmon::HardwareCounters::EVENT_COUNT];
+    // In nanoseconds.
+    util::statistics::Histogram latencies;
+    util::statistics::Percentile<float> rates;
+    util::statistics::Percentile<float> tie_rates;
+    // The recall of a MIXED case before any write.
+    util::statistics::Percentile<float> initial_rates;
+
+    CaseResult() : qps(0), write_qps(0), cpu_util(0), mem_r_bw(0),
+            mem_w_bw(0), counters(), rates(false), tie_rates(false),
+            initial_rates(false) {}
+};
+
+void Benchmark(const CaseContext& context, const TestCase& test_case,
+        size_t case_index, CaseResult& result) {
+    const std::vector<const faiss::Index*>& indexes = context.indexes;
+    const std::vector<util::numa::Node>& nodes = context.nodes;
+    size_t count = context.count;
+    size_t top_k1 = context.top_k1;
+    size_t top_k2 = context.top_k2;
+    const float* queries = context.queries;
+    const faiss::idx_t* groundtruths = context.groundtruths;
+    const float* thresholds = context.thresholds;
+    float epsilon = context.epsilon;
+    IntervalReporter* reporter = context.reporter;
+    Updates* updates = context.updates;
+    double* counters = context.counting ? result.counters : nullptr;
+    if (test_case.threads.empty()) {
+        throw std::runtime_error("<thread_count = 0> is invalid!");
+    }
+    std::unique_ptr<faiss::idx_t[]> labels(
+            NewZeroOutArray<faiss::idx_t>(count * top_k2));
+    std::unique_ptr<float[]> distances(
+            NewZeroOutArray<float>(count * top_k2));
+    bool is_mixed = test_case.mode == TestCase::MIXED;
+    // A MIXED case writes a copy of the index, searched by all threads.
+    std::vector<const faiss::Index*> case_indexes(indexes);
+    std::unique_ptr<faiss::Index> copy;
+    std::vector<faiss::idx_t> gts;
+    if (is_mixed) {
+        if (!updates) {
+            throw std::runtime_error("mixed cases need --writes!");
+        }
+        copy.reset(faiss::clone_index(indexes[0]));
+        case_indexes.assign(indexes.size(), copy.get());
+        updates->reset(copy->ntotal);
+        thresholds = nullptr;
+    }
+    bool is_static = test_case.mode == TestCase::STATIC || is_mixed;
+    if (test_case.warmup_queries > 0 || test_case.warmup_duration > 0) {
+        util::statistics::Histogram warmup_latencies;
+        RunStatic(case_indexes, nodes, count, top_k2, queries, test_case,
+                is_static ? test_case.batch_size : test_case.max_batch,
+                test_case.warmup_queries > 0 ? test_case.warmup_queries :
+                SIZE_MAX, test_case.warmup_duration, nullptr, nullptr,
+                nullptr, labels.get(), distances.get(), warmup_latencies);
+    }
+    if (is_mixed) {
+        // The recall before any write.
+        util::statistics::Percentile<float> unused(false);
+        copy->search(count, queries, top_k2, distances.get(), labels.get());
+        gts = updates->groundtruths(count, top_k1);
+        Evaluate(count, top_k1, top_k2, gts.data(), labels.get(),
+                distances.get(), nullptr, epsilon, result.initial_rates,
+                unused);
+    }
+    util::perfmon::CPUUtilization cpu_mon(true, true);
+    util::perfmon::MemoryBandwidth mem_mon;
+    cpu_mon.start();
+    mem_mon.start();
+    ScopedReport report(reporter, case_index, test_case.threads.size(),
+            &mem_mon);
+    uint64_t all_start_ns = util::perfmon::Clock::nanosecond();
+    RWLock lock;
+    std::future<void> writer;
+    if (is_mixed) {
+        writer = std::async(std::launch::async, RunWriter, copy.get(),
+                std::ref(*updates), std::ref(lock), std::cref(test_case),
+                all_start_ns, all_start_ns +
+                (uint64_t)(test_case.duration * 1000000000));
+    }
+    size_t vcount = is_static ?
+            RunStatic(case_indexes, nodes, count, top_k2, queries,
+            test_case, test_case.batch_size, test_case.loop > 0 ?
+            test_case.loop * count : SIZE_MAX, test_case.duration,
+            reporter, counters, is_mixed ? &lock : nullptr, labels.get(),
+            distances.get(), result.latencies) :
+            RunDynamic(indexes, nodes, count, top_k2, queries, test_case,
+            reporter, counters, labels.get(), distances.get(),
+            result.latencies);
+    if (is_mixed) {
+        writer.get();
+    }
+    uint64_t all_end_ns = util::perfmon::Clock::nanosecond();
+    report.stop();
+    result.cpu_util = cpu_mon.end();
+    mem_mon.end(result.mem_r_bw, result.mem_w_bw);
+    result.qps = 1000000000.0 * vcount / (all_end_ns - all_start_ns);
+    result.write_qps = is_mixed ? 1000000000.0 * updates->writes() /
+            (all_end_ns - all_start_ns) : 0;
+    if (is_mixed) {
+        // The recall after the writes, against the vectors left.
+        copy->search(count, queries, top_k2, distances.get(), labels.get());
+        gts = updates->groundtruths(count, top_k1);
+        groundtruths = gts.data();
+    }
+    else {
+        // A short case may not reach every query.
+        count = std::min(count, vcount);
+    }
+    if (thresholds &&
+            indexes[0]->metric_type == faiss::METRIC_INNER_PRODUCT) {
+        // The distances of 'ip' in groundtruth are the negative products.
+        float* ds = distances.get();
+        for (size_t i = 0; i < count * top_k2; i++) {
+            ds[i] = -ds[i];
+        }
+    }
+    Evaluate(count, top_k1, top_k2, groundtruths, labels.get(),
+            distances.get(), thresholds, epsilon, result.rates,
+            result.tie_rates);
 #ifdef PRINT_LABELS
     faiss::idx_t* plabel = labels.get (); 
     for (size_t i = 0; i < count; i++) {
@@ -180,23 +1013,11 @@ template <typename T>
 std::shared_ptr<float> PrepareQueries(util::vecs::File* file, size_t dim,
         size_t& count) {
     util::vecs::Formater<T> reader(file);
-    count = 0;
-    while (reader.skip()) {
-        count++;
-    }
-    reader.reset();
-    float* cursor = new float[count * dim];
-    std::shared_ptr<float> queries(cursor);
-    util::vector::Converter<T, float> converter;
-    for (size_t i = 0; i < count; i++) {
-        std::vector<T> vector = reader.read();
-        if (vector.size() != dim) {
-            char buf[256];
-            sprintf(buf, "query vector is not %luD!", dim);
-            throw std::runtime_error(buf);
-        }
-        converter(cursor, vector);
-        cursor += dim;
+    count = reader.count();
+    std::shared_ptr<float> queries(new float[count * dim],
+            std::default_delete<float[]>());
+    if (reader.readMatrix(count, dim, queries.get()) != count) {
+        throw std::runtime_error("broken file of query vectors!");
     }
     return queries;
 }
@@ -211,6 +1032,7 @@ std::shared_ptr<float> PrepareQueries(const char* fpath, size_t dim,
         func_t func;
     }
     entries[] = {
+        {'c', PrepareQueries<int8_t>},
         {'b', PrepareQueries<uint8_t>},
         {'i', PrepareQueries<int32_t>},
         {'f', PrepareQueries<float>},
@@ -224,33 +1046,54 @@ std::shared_ptr<float> PrepareQueries(const char* fpath, size_t dim,
     throw std::runtime_error("unsupported format of query vectors!");
 }
 
+// If <gt_file> is an .ibin followed by a block of float distances, as in
+// big-ann-benchmarks, the <top_n>-th distances are stored in <thresholds>.
 template <typename T>
 std::shared_ptr<faiss::idx_t> PrepareGroundTruths(size_t count,
-        size_t top_n, util::vecs::File* gt_file) {
+        size_t top_n, util::vecs::File* gt_file,
+        std::vector<float>& thresholds) {
     faiss::idx_t* cursor = new faiss::idx_t[count * top_n];
-    std::shared_ptr<faiss::idx_t> gts(cursor);
+    std::shared_ptr<faiss::idx_t> gts(cursor,
+            std::default_delete<faiss::idx_t[]>());
     util::vecs::Formater<T> reader(gt_file);
+    size_t rows = reader.count();
+    size_t columns = 0;
     util::vector::Converter<T, faiss::idx_t> converter;
     for (size_t i = 0; i < count; i++) {
-        std::vector<T> gt = reader.read();
-        if (gt.size() < top_n) {
+        size_t dim;
+        const T* gt = reader.view(dim);
+        if (dim < top_n) {
             char buf[256];
             sprintf(buf, "groundtruth vector is less than %luD!", top_n);
             throw std::runtime_error(buf);
         }
-        gt.resize(top_n);
-        std::sort(gt.begin(), gt.end());
-        converter(cursor, gt);
+        columns = dim;
+        converter(cursor, gt, top_n);
+        std::sort(cursor, cursor + top_n);
         cursor += top_n;
     }
+    size_t matrix = 2 * sizeof(uint32_t) + sizeof(T) * rows * columns;
+    if (gt_file->isDense() && gt_file->size() ==
+            (ssize_t)(matrix + sizeof(float) * rows * columns)) {
+        thresholds.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            size_t offset = sizeof(float) * (i * columns + top_n - 1);
+            if (gt_file->seek(matrix + offset, SEEK_SET) < 0 ||
+                    gt_file->read(&thresholds[i], sizeof(float)) !=
+                    sizeof(float)) {
+                throw std::runtime_error("broken file of groundtruth "
+                        "vectors!");
+            }
+        }
+    }
     return gts;
 }
 
 std::shared_ptr<faiss::idx_t> PrepareGroundTruths(size_t count,
-        size_t top_n, const char* fpath) {
+        size_t top_n, const char* fpath, std::vector<float>& thresholds) {
     util::vecs::SuffixWrapper gt(fpath, true);    
     typedef std::shared_ptr<faiss::idx_t> (*func_t)(size_t, size_t,
-            util::vecs::File*);
+            util::vecs::File*, std::vector<float>&);
     static const struct Entry {
         char type;
         func_t func;
@@ -261,30 +1104,109 @@ std::shared_ptr<faiss::idx_t> PrepareGroundTruths(size_t count,
     for (size_t i = 0; i < sizeof(entries) / sizeof(Entry); i++) {
         const Entry* entry = entries + i;
         if (gt.getDataType() == entry->type) {
-            return entry->func(count, top_n, gt.getFile());
+            return entry->func(count, top_n, gt.getFile(), thresholds);
         }
     }
     throw std::runtime_error("unsupported format of groundtruth vectors!");
 }
 
+// Read the <top_n>-th distance of each query from the distances written by
+// groundtruth --distances.
+std::vector<float> PrepareThresholds(size_t count, size_t top_n,
+        const char* fpath) {
+    util::vecs::SuffixWrapper dist(fpath, true);
+    if (dist.getDataType() != 'f') {
+        throw std::runtime_error("the file of groundtruth distances should "
+                "be .fvecs or .fbin!");
+    }
+    util::vecs::Formater<float> reader(dist.getFile());
+    std::vector<float> thresholds(count);
+    for (size_t i = 0; i < count; i++) {
+        size_t dim;
+        const float* distances = reader.view(dim);
+        if (dim < top_n) {
+            char buf[256];
+            sprintf(buf, "groundtruth distance vector is less than %luD!",
+                    top_n);
+            throw std::runtime_error(buf);
+        }
+        thresholds[i] = distances[top_n - 1];
+    }
+    return thresholds;
+}
+
+// Read the whole rows of the first <count> groundtruth vectors in order.
+template <typename T>
+std::shared_ptr<faiss::idx_t> PrepareRankings(size_t count,
+        util::vecs::File* gt_file, size_t& columns) {
+    util::vecs::Formater<T> reader(gt_file);
+    std::shared_ptr<faiss::idx_t> rankings;
+    util::vector::Converter<T, faiss::idx_t> converter;
+    for (size_t i = 0; i < count; i++) {
+        size_t dim;
+        const T* gt = reader.view(dim);
+        if (!gt) {
+            throw std::runtime_error("broken file of groundtruth vectors!");
+        }
+        if (i == 0) {
+            columns = dim;
+            rankings.reset(new faiss::idx_t[count * columns],
+                    std::default_delete<faiss::idx_t[]>());
+        }
+        else if (dim != columns) {
+            throw std::runtime_error("groundtruth vectors are not of the "
+                    "same dimension!");
+        }
+        converter(rankings.get() + i * columns, gt, columns);
+    }
+    return rankings;
+}
+
+std::shared_ptr<faiss::idx_t> PrepareRankings(size_t count,
+        const char* fpath, size_t& columns) {
+    util::vecs::SuffixWrapper gt(fpath, true);
+    if (gt.getDataType() != 'i') {
+        throw std::runtime_error("unsupported format of groundtruth "
+                "vectors!");
+    }
+    return PrepareRankings<int32_t>(count, gt.getFile(), columns);
+}
+
 template <typename T>
 void OutputValue(const char* name, T value) {
     std::cout << name << ": " << value << std::endl;
 }
 
+// Output the totals of the worker threads and the averages per query, and
+// the instructions per cycle.
+void OutputCounters(const double* counters, size_t query_count) {
+    typedef util::perfmon::HardwareCounters HardwareCounters;
+    for (int i = 0; i < HardwareCounters::EVENT_COUNT; i++) {
+        std::cout << HardwareCounters::name((HardwareCounters::Event)i) <<
+                ": total=" << counters[i] << " per-query=" <<
+                counters[i] / query_count << std::endl;
+    }
+    OutputValue("ipc", counters[HardwareCounters::INSTRUCTIONS] /
+            counters[HardwareCounters::CYCLES]);
+}
+
 struct Percentage {
     std::string str;
     double value;
 };
 
-template <typename T>
+// <statistics> is a Percentile or a Histogram, whose values are multiplied
+// by <scale>.
+template <typename TStatistics>
 void OutputStatistics(const char* name,
         const std::vector<Percentage>& percentages,
-        util::statistics::Percentile<T>& percentile) {
-    std::cout << name << ": best=" << percentile.best() << " worst=" <<
-            percentile.worst() << " average=" << percentile.average();
+        TStatistics& statistics, double scale = 1.0) {
+    std::cout << name << ": best=" << statistics.best() * scale <<
+            " worst=" << statistics.worst() * scale << " average=" <<
+            statistics.average() * scale;
     for (auto it = percentages.begin(); it != percentages.end(); it++) {
-        std::cout << " P(" << it->str << "%)=" << percentile(it->value);
+        std::cout << " P(" << it->str << "%)=" <<
+                statistics(it->value) * scale;
     }
     std::cout << std::endl;
 }
@@ -312,18 +1234,97 @@ std::vector<TestCase> ParseTestCases(const char* joint_cases) {
     auto case_func = [&](const char* case_item, size_t case_len) -> int {
         std::string case_str(case_item, case_len);
         case_item = case_str.data();
-        size_t loop, batch_size, thread_count;
+        std::runtime_error error(std::string("unrecognizable case: '")
+                .append(case_item, case_len).append("'!"));
+        size_t thread_count;
         const char* pos1 = strstr(case_item, "/");
-        if (!pos1 || sscanf(pos1, "/%lux%lux%lu",
-                &loop, &batch_size, &thread_count) != 3) {
-            throw std::runtime_error(std::string("unrecognizable case: '")
-                    .append(case_item, case_len).append("'!"));
+        if (!pos1) {
+            throw error;
         }
         TestCase t;
         t.parameters.assign(case_item, pos1 - case_item);
-        t.loop = loop;
-        t.batch_size = batch_size;
-        const char* pos2 = strstr(pos1, ":");
+        t.mode = TestCase::STATIC;
+        t.loop = 0;
+        t.batch_size = 1;
+        t.rate = 0;
+        t.clients = 0;
+        t.add_rate = 0;
+        t.remove_rate = 0;
+        t.duration = 0;
+        t.max_batch = 1;
+        t.max_wait_us = 0;
+        t.warmup_queries = 0;
+        t.warmup_duration = 0;
+        const char* spec = pos1 + 1;
+        int len = 0;
+        // The optional warmup: <queries>+ or <seconds>s+.
+        double warmup;
+        if (sscanf(spec, "%lf%n", &warmup, &len) == 1 && (spec[len] == '+' ||
+                (spec[len] == 's' && spec[len + 1] == '+'))) {
+            if (warmup <= 0) {
+                throw error;
+            }
+            if (spec[len] == 's') {
+                t.warmup_duration = warmup;
+                len++;
+            }
+            else {
+                t.warmup_queries = (size_t)warmup;
+            }
+            spec += len + 1;
+        }
+        if (sscanf(spec, "open:%lfqps:%lfs:%lu%n", &t.rate, &t.duration,
+                &thread_count, &len) == 3) {
+            t.mode = TestCase::OPEN;
+        }
+        else if (sscanf(spec, "fixed:%lfqps:%lfs:%lu%n", &t.rate,
+                &t.duration, &thread_count, &len) == 3) {
+            t.mode = TestCase::FIXED;
+        }
+        else if (sscanf(spec, "closed:%luc:%lfs:%lu%n", &t.clients,
+                &t.duration, &thread_count, &len) == 3) {
+            t.mode = TestCase::CLOSED;
+        }
+        else if (sscanf(spec, "mixed:%lfaps:%lfrps:%lfs:%lu%n", &t.add_rate,
+                &t.remove_rate, &t.duration, &thread_count, &len) == 4) {
+            t.mode = TestCase::MIXED;
+            if (t.add_rate < 0 || t.remove_rate < 0 || t.duration <= 0) {
+                throw error;
+            }
+        }
+        else if (sscanf(spec, "%lfsx%lux%lu%n", &t.duration, &t.batch_size,
+                &thread_count, &len) == 3) {
+            if (t.duration <= 0) {
+                throw error;
+            }
+        }
+        else if (sscanf(spec, "%lux%lux%lu%n", &t.loop, &t.batch_size,
+                &thread_count, &len) != 3 || t.loop == 0) {
+            throw error;
+        }
+        const char* pos2 = spec + len;
+        if (t.mode != TestCase::STATIC && t.mode != TestCase::MIXED) {
+            if ((t.mode != TestCase::CLOSED && t.rate <= 0) ||
+                    t.duration <= 0) {
+                throw error;
+            }
+            // The optional policy of batching: x<max_batch>[@<max_wait>us].
+            if (*pos2 == 'x') {
+                if (sscanf(pos2, "x%lu%n", &t.max_batch, &len) != 1) {
+                    throw error;
+                }
+                pos2 += len;
+                if (*pos2 == '@') {
+                    if (sscanf(pos2, "@%luus%n", &t.max_wait_us, &len) != 1) {
+                        throw error;
+                    }
+                    pos2 += len;
+                }
+            }
+        }
+        if (*pos2 != ':') {
+            pos2 = nullptr;
+        }
         if (!pos2) {
             for (size_t i = 0; i < thread_count; i++) {
                 t.threads.emplace_back(-1);
@@ -352,63 +1353,803 @@ std::vector<TestCase> ParseTestCases(const char* joint_cases) {
     return test_cases;
 }
 
-void Benchmark(const char* index_fpath, const char* query_fpath,
-        const char* gt_fpath, size_t top_k1, size_t top_k2, const char* joint_percentages,
-        const char* joint_cases) {
-    std::unique_ptr<faiss::Index> index(faiss::read_index(index_fpath));
+struct OperatingPoint {
+    size_t combination;
+    std::string name;
+    float recall;
+    float qps;
+    // In microseconds.
+    double p99;
+};
+
+// Tune the parameters of faiss::ParameterSpace for <test_case>, on
+// <sample_count> queries picked evenly. The parameters given by the case are
+// kept. The rest are screened in rounds over the first 1/8, 1/4, 1/2 and all
+// of the sample, by the recall of a single batch: a combination is dropped
+// once its recall is below <target> by twice the error of the round, and so
+// is every combination not greater in any parameter, or once it is greater
+// in every parameter than another reaching <target>, as recall and cost grow
+// with each parameter. The combinations left and the greatest ones below
+// <target> are then run as <test_case>. Output the Pareto frontier of them
+// in (recall, qps, p99), and the best reaching <target> by qps, or by p99 if
+// <by_latency>. They are only reported, and every case is tuned anew.
+void Tune(const std::vector<std::unique_ptr<faiss::Index>>& replicas,
+        const CaseContext& context, const TestCase& test_case, float target,
+        bool by_latency, size_t sample_count) {
+    if (test_case.mode == TestCase::MIXED) {
+        throw std::runtime_error("mixed cases can not be tuned!");
+    }
+    const std::vector<const faiss::Index*>& indexes = context.indexes;
+    size_t count = context.count;
+    size_t top_k1 = context.top_k1;
+    size_t top_k2 = context.top_k2;
+    const float* queries = context.queries;
+    const faiss::idx_t* groundtruths = context.groundtruths;
+    float epsilon = context.epsilon;
+    size_t dim = indexes[0]->d;
+    sample_count = std::min(sample_count, count);
+    std::vector<float> xs(sample_count * dim);
+    std::vector<faiss::idx_t> gs(sample_count * top_k1);
+    for (size_t i = 0; i < sample_count; i++) {
+        size_t j = i * count / sample_count;
+        memcpy(xs.data() + i * dim, queries + j * dim, sizeof(float) * dim);
+        memcpy(gs.data() + i * top_k1, groundtruths + j * top_k1,
+                sizeof(faiss::idx_t) * top_k1);
+    }
+    CaseContext sample = context;
+    sample.count = sample_count;
+    sample.queries = xs.data();
+    sample.groundtruths = gs.data();
+    sample.thresholds = nullptr;
+    sample.reporter = nullptr;
+    sample.updates = nullptr;
+    sample.counting = false;
+    faiss::ParameterSpace ps;
+    ps.initialize(indexes[0]);
+    std::vector<std::string> fixed;
+    auto func = [&](const char* item, size_t len) -> int {
+        const char* eq = (const char*)memchr(item, '=', len);
+        fixed.emplace_back(item, eq ? eq - item : len);
+        return 0;
+    };
+    util::string::split(test_case.parameters.data(), ",", &func);
+    for (auto it = ps.parameter_ranges.begin();
+            it != ps.parameter_ranges.end();) {
+        if (std::find(fixed.begin(), fixed.end(), it->name) != fixed.end()) {
+            it = ps.parameter_ranges.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+    auto apply = [&](size_t combination) {
+        for (auto it = replicas.begin(); it != replicas.end(); it++) {
+            ps.set_index_parameters(it->get(), combination);
+        }
+    };
+    size_t combination_count = ps.n_combinations();
+    std::vector<size_t> alive;
+    for (size_t c = 0; c < combination_count; c++) {
+        alive.push_back(c);
+    }
+    std::vector<size_t> below;
+    std::vector<faiss::idx_t> ls(sample_count * top_k2);
+    std::vector<float> ds(sample_count * top_k2);
+    size_t evaluations = 0;
+    for (size_t n = std::max<size_t>(sample_count / 8, 1); ;
+            n = std::min(n * 2, sample_count)) {
+        bool last = n == sample_count;
+        std::vector<size_t> next, reached;
+        for (auto it = alive.begin(); it != alive.end(); it++) {
+            size_t c = *it;
+            bool dropped = false;
+            for (auto b = below.begin(); !dropped && b != below.end(); b++) {
+                dropped = ps.combination_ge(*b, c);
+            }
+            if (dropped) {
+                continue;
+            }
+            apply(c);
+            indexes[0]->search(n, xs.data(), top_k2, ds.data(), ls.data());
+            util::statistics::Percentile<float> rates(false);
+            util::statistics::Percentile<float> unused(false);
+            Evaluate(n, top_k1, top_k2, gs.data(), ls.data(), ds.data(),
+                    nullptr, epsilon, rates, unused);
+            evaluations++;
+            float recall = rates.average();
+            float error = last ? 0.0f :
+                    2 * std::sqrt(recall * (1 - recall) / (n * top_k1));
+            if (recall + error < target) {
+                below.push_back(c);
+                continue;
+            }
+            next.push_back(c);
+            if (recall - error >= target) {
+                reached.push_back(c);
+            }
+        }
+        alive.clear();
+        for (auto it = next.begin(); it != next.end(); it++) {
+            bool greater = false;
+            for (auto r = reached.begin(); !greater && r != reached.end();
+                    r++) {
+                greater = *r != *it && ps.combination_ge(*it, *r);
+            }
+            if (!greater) {
+                alive.push_back(*it);
+            }
+        }
+        if (last) {
+            break;
+        }
+    }
+    OutputValue("evaluations", evaluations);
+    std::vector<size_t> candidates(alive);
+    for (auto it = below.begin(); it != below.end(); it++) {
+        bool greatest = true;
+        for (auto b = below.begin(); greatest && b != below.end(); b++) {
+            greatest = *b == *it || !ps.combination_ge(*b, *it);
+        }
+        if (greatest) {
+            candidates.push_back(*it);
+        }
+    }
+    std::vector<OperatingPoint> points;
+    for (auto it = candidates.begin(); it != candidates.end(); it++) {
+        CaseResult result;
+        apply(*it);
+        Benchmark(sample, test_case, 0, result);
+        points.push_back({*it, ps.combination_name(*it),
+                (float)result.rates.average(), result.qps,
+                result.latencies(99) * 0.001});
+    }
+    std::sort(points.begin(), points.end(),
+            [](const OperatingPoint& a, const OperatingPoint& b) {
+        return a.recall < b.recall;
+    });
+    const OperatingPoint* best = nullptr;
+    for (size_t i = 0; i < points.size(); i++) {
+        const OperatingPoint& p = points[i];
+        bool dominated = false;
+        for (auto q = points.begin(); !dominated && q != points.end(); q++) {
+            dominated = q->recall >= p.recall && q->qps >= p.qps &&
+                    q->p99 <= p.p99 && (q->recall > p.recall ||
+                    q->qps > p.qps || q->p99 < p.p99);
+        }
+        if (!dominated) {
+            std::cout << "pareto: parameters=" << p.name << " recall=" <<
+                    p.recall << " qps=" << p.qps << " p99=" << p.p99 <<
+                    std::endl;
+        }
+        if (p.recall >= target && (!best || (by_latency ?
+                p.p99 < best->p99 : p.qps > best->qps))) {
+            best = &p;
+        }
+    }
+    if (!best) {
+        std::cout << "best: none" << std::endl;
+        return;
+    }
+    std::cout << "best: parameters=" << best->name << " recall=" <<
+            best->recall << " qps=" << best->qps << " p99=" << best->p99 <<
+            std::endl;
+}
+
+// Load a replica of the index for each node, by a thread bound to the node so
+// that the replica is allocated there.
+std::vector<std::unique_ptr<faiss::Index>> LoadReplicas(
+        const char* index_fpath, int io_flags,
+        const std::vector<util::numa::Node>& nodes) {
+    std::vector<std::unique_ptr<faiss::Index>> replicas(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        std::exception_ptr error;
+        std::thread thread([&] {
+            try {
+                util::numa::Bind(nodes[i]);
+                replicas[i].reset(faiss::read_index(index_fpath, io_flags));
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+        });
+        thread.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return replicas;
+}
+
+struct LoadedIndex {
+    // Empty unless there is a replica for each node.
+    std::vector<util::numa::Node> nodes;
+    std::vector<std::unique_ptr<faiss::Index>> replicas;
+    // The growth of the resident set by loading, in KB.
+    size_t size;
+};
+
+std::shared_ptr<LoadedIndex> LoadIndex(const char* index_fpath, int io_flags,
+        bool numa) {
+    std::shared_ptr<LoadedIndex> index(new LoadedIndex());
+    util::perfmon::MemorySize mem_mon;
+    size_t start_size = mem_mon.getResidentSetSize();
+    if (numa) {
+        index->nodes = util::numa::GetNodes();
+        index->replicas = LoadReplicas(index_fpath, io_flags, index->nodes);
+    }
+    else {
+        index->replicas.emplace_back(faiss::read_index(index_fpath,
+                io_flags));
+    }
+    size_t end_size = mem_mon.getResidentSetSize();
+    index->size = end_size > start_size ? end_size - start_size : 0;
+    return index;
+}
+
+// Evict the pages of the file at <fpath> from the page cache, so that it is
+// read from the disk again as after a restart.
+void DropPageCache(const char* fpath) {
+    int fd = open(fpath, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("failed to open '")
+                .append(fpath).append("'!"));
+    }
+    // Dirty pages are not dropped.
+    fdatasync(fd);
+    int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (ret != 0) {
+        throw std::runtime_error("failed to posix_fadvise()!");
+    }
+}
+
+// Search the first <startup_count> queries one by one, right after loading,
+// while the pages of an index by mmap are still faulting in. <first_ns> is
+// the latency of the first one.
+void RunStartup(const faiss::Index* index, size_t count, size_t top_k2,
+        const float* queries, size_t startup_count, uint64_t& first_ns,
+        util::statistics::Histogram& latencies) {
     size_t dim = index->d;
-    size_t count;
-    std::shared_ptr<float> queries = PrepareQueries(query_fpath, dim, count);
-    std::shared_ptr<faiss::idx_t> gts = PrepareGroundTruths(count,
-            top_k1, gt_fpath);
+    std::vector<float> distances(top_k2);
+    std::vector<faiss::idx_t> labels(top_k2);
+    for (size_t i = 0; i < startup_count; i++) {
+        uint64_t start_ns = util::perfmon::Clock::nanosecond();
+        index->search(1, queries + i % count * dim, top_k2,
+                distances.data(), labels.data());
+        uint64_t latency_ns = util::perfmon::Clock::nanosecond() - start_ns;
+        if (i == 0) {
+            first_ns = latency_ns;
+        }
+        latencies.add(latency_ns);
+    }
+}
+
+// The indexes, queries and groundtruths loaded by the requests of 'serve',
+// kept for the later requests by their paths and arguments.
+struct Cache {
+    std::map<std::string, std::shared_ptr<LoadedIndex>> indexes;
+    std::map<std::string, std::pair<std::shared_ptr<float>, size_t>> queries;
+    std::map<std::string, std::pair<std::shared_ptr<faiss::idx_t>,
+            std::vector<float>>> groundtruths;
+};
+
+// Return the value of <key> in <cache>, loaded by <load> if missing, or just
+// load it if <cache> is nullptr.
+template <typename T, typename TLoad>
+T Cached(std::map<std::string, T>* cache, const std::string& key,
+        TLoad load) {
+    if (!cache) {
+        return load();
+    }
+    auto it = cache->find(key);
+    if (it == cache->end()) {
+        it = cache->emplace(key, load()).first;
+    }
+    return it->second;
+}
+
+std::shared_ptr<LoadedIndex> LoadIndex(const char* index_fpath, int io_flags,
+        bool numa, Cache* cache) {
+    char key[256];
+    sprintf(key, "@%d%s", io_flags, numa ? "@numa" : "");
+    return Cached(cache ? &cache->indexes : nullptr,
+            std::string(index_fpath).append(key), [&] {
+        return LoadIndex(index_fpath, io_flags, numa);
+    });
+}
+
+// The options of the command line.
+struct Options {
+    size_t top_k1;
+    size_t top_k2;
+    const char* gt_dist_fpath;
+    float epsilon;
+    bool numa;
+    const char* interval_fpath;
+    uint64_t interval_ms;
+    bool counting;
+    const char* writes_fpath;
+    const char* writes_gt_fpath;
+    float tune_target;
+    bool tune_latency;
+    size_t tune_sample_count;
+    int io_flags;
+    bool dropping;
+    size_t startup_count;
+};
+
+void Benchmark(const char* index_fpath, const char* query_fpath,
+        const char* gt_fpath, const char* joint_percentages,
+        const char* joint_cases, const Options& options, Cache* cache) {
+    if (options.dropping) {
+        DropPageCache(index_fpath);
+    }
+    // A cold start is timed on a fresh load, which is not kept.
+    bool cold = options.dropping || options.startup_count > 0;
+    uint64_t load_start_ns = util::perfmon::Clock::nanosecond();
+    std::shared_ptr<LoadedIndex> index = LoadIndex(index_fpath,
+            options.io_flags, options.numa, cold ? nullptr : cache);
+    uint64_t load_ns = util::perfmon::Clock::nanosecond() - load_start_ns;
+    const std::vector<util::numa::Node>& nodes = index->nodes;
+    const std::vector<std::unique_ptr<faiss::Index>>& replicas =
+            index->replicas;
+    std::vector<const faiss::Index*> indexes;
+    for (auto it = replicas.begin(); it != replicas.end(); it++) {
+        indexes.push_back(it->get());
+    }
+    size_t dim = indexes[0]->d;
+    char key[256];
+    sprintf(key, "@%lu", dim);
+    auto query = Cached(cache ? &cache->queries : nullptr,
+            std::string(query_fpath).append(key), [&] {
+        size_t count;
+        std::shared_ptr<float> queries = PrepareQueries(query_fpath, dim,
+                count);
+        return std::make_pair(queries, count);
+    });
+    std::shared_ptr<float> queries = query.first;
+    size_t count = query.second;
+    sprintf(key, "@%lu@%lu", count, options.top_k1);
+    auto gt = Cached(cache ? &cache->groundtruths : nullptr,
+            std::string(gt_fpath).append(key), [&] {
+        std::vector<float> thresholds;
+        std::shared_ptr<faiss::idx_t> gts = PrepareGroundTruths(count,
+                options.top_k1, gt_fpath, thresholds);
+        return std::make_pair(gts, thresholds);
+    });
+    std::shared_ptr<faiss::idx_t> gts = gt.first;
+    std::vector<float> thresholds = gt.second;
+    if (options.gt_dist_fpath) {
+        thresholds = PrepareThresholds(count, options.top_k1,
+                options.gt_dist_fpath);
+    }
+    std::unique_ptr<Updates> updates;
+    if (options.writes_fpath) {
+        size_t vector_count, columns;
+        std::shared_ptr<float> vectors = PrepareQueries(options.writes_fpath,
+                dim, vector_count);
+        std::shared_ptr<faiss::idx_t> rankings = PrepareRankings(count,
+                options.writes_gt_fpath, columns);
+        updates.reset(new Updates(vectors, vector_count, dim, rankings,
+                columns));
+    }
     std::vector<Percentage> percentages = ParsePercentages(joint_percentages);
     std::vector<TestCase> test_cases = ParseTestCases(joint_cases);
+    std::unique_ptr<IntervalReporter> reporter;
+    if (options.interval_fpath) {
+        reporter.reset(new IntervalReporter(options.interval_fpath,
+                options.interval_ms));
+    }
+    CaseContext context = {indexes, nodes, count, options.top_k1,
+            options.top_k2, queries.get(), gts.get(),
+            thresholds.empty() ? nullptr : thresholds.data(), options.epsilon,
+            reporter.get(), updates.get(), options.counting};
     faiss::ParameterSpace ps;
+    if (cold) {
+        // In milliseconds.
+        OutputValue("load-time", load_ns / 1e6);
+    }
+    if (options.startup_count > 0) {
+        if (test_cases.empty()) {
+            throw std::runtime_error("--startup needs a case for the "
+                    "parameters!");
+        }
+        // The queries and groundtruths are loaded after the index, but they
+        // touch none of its pages.
+        ps.set_index_parameters(replicas[0].get(),
+                test_cases[0].parameters.data());
+        uint64_t first_ns;
+        util::statistics::Histogram latencies;
+        RunStartup(indexes[0], count, options.top_k2, queries.get(),
+                options.startup_count, first_ns, latencies);
+        OutputValue("first-query", (load_ns + first_ns) / 1e6);
+        OutputStatistics("startup-latency", percentages, latencies, 0.001);
+    }
     for (auto iter = test_cases.begin(); iter != test_cases.end(); iter++) {
-        float qps, cpu_util, mem_r_bw, mem_w_bw;
-        util::statistics::Percentile<uint32_t> latencies(true);
-        util::statistics::Percentile<float> rates(false);
-        ps.set_index_parameters(index.get(), iter->parameters.data());
-        Benchmark(index.get(), count, top_k1, top_k2, queries.get(), gts.get(),
-                *iter, qps, cpu_util, mem_r_bw, mem_w_bw, latencies, rates);
-        OutputValue("qps", qps);
-        OutputValue("cpu-util", cpu_util);
-        OutputValue("mem-r-bw", mem_r_bw);
-        OutputValue("mem-w-bw", mem_w_bw);
-        OutputStatistics("latency", percentages, latencies);
-        OutputStatistics("recall", percentages, rates);
+        CaseResult result;
+        for (auto it = replicas.begin(); it != replicas.end(); it++) {
+            ps.set_index_parameters(it->get(), iter->parameters.data());
+        }
+        if (options.tune_target > 0) {
+            Tune(replicas, context, *iter, options.tune_target,
+                    options.tune_latency, options.tune_sample_count);
+            continue;
+        }
+        Benchmark(context, *iter, iter - test_cases.begin(), result);
+        bool is_mixed = iter->mode == TestCase::MIXED;
+        if (iter->mode == TestCase::OPEN || iter->mode == TestCase::FIXED) {
+            OutputValue("offered-qps", iter->rate);
+        }
+        if (is_mixed) {
+            OutputValue("write-qps", result.write_qps);
+        }
+        OutputValue("qps", result.qps);
+        OutputValue("cpu-util", result.cpu_util);
+        OutputValue("mem-r-bw", result.mem_r_bw);
+        OutputValue("mem-w-bw", result.mem_w_bw);
+        // In microseconds, from the nanoseconds recorded.
+        OutputStatistics("latency", percentages, result.latencies, 0.001);
+        OutputStatistics("recall", percentages, result.rates);
+        if (is_mixed) {
+            OutputValue("recall-drift", result.rates.average() -
+                    result.initial_rates.average());
+        }
+        else if (!thresholds.empty()) {
+            OutputStatistics("tie-recall", percentages, result.tie_rates);
+        }
+        if (options.counting) {
+            OutputCounters(result.counters, result.latencies.count());
+        }
     }
 }
 
-int main(int argc, char** argv) {
-    size_t top_k1, top_k2;
-    if (argc != 7 || sscanf(argv[4], "%lu@%lu", &top_k1, &top_k2) != 2 || top_k1 > top_k2) {
-        fprintf(stderr, "%s <index> <query> <gt> <k1@k2> <percentages> "
-                "<cases>\n"
-                "Load index from <index> if it exists. Then run several "
-                "cases of benchmarks. The vectors to query are from <query>,"
-                " the groundtruth vectors are from <gt>. Find <k2> nearest"
-                " neighbors for each query vector. The result is consist of "
-                "statistics of latency and recall rate. The recall rate is k1@k2. "
-                "Besides the best, worst and average, percentiles at <percentages> will be "
-                "displayed additionally. For example, if <percentages> = '50,"
-                "99,99.9', then 50-percentile, 99-percentile and "
-                "99.9-percentile of latency and recall rates will be "
-                "displayed. <cases> is a semicolon-split string of serval "
-                "benchmark cases, each is in format of "
-                "[parameters]/<loop>x<batch_size>x<thread_count>[:<cpu-list>] "
-                "(e.g. 'nprobe=32/10x1x4' or 'nprobe=64/10x4x4:0,1,2,3')\n",
-                argv[0]);
-        return 1;
+void PrintUsage(const char* name) {
+    fprintf(stderr, "%s <index> <query> <gt> <k1@k2> <percentages> "
+            "<cases> [--gt-distances <dist>] [--epsilon <epsilon>] "
+            "[--numa] [--intervals <ms> <file>] [--counters] "
+            "[--writes <vectors> <gt>] [--tune <recall> <qps/latency>] "
+            "[--tune-sample <count>] [--load <read/mmap/mmap-ro>] "
+            "[--drop-cache] [--startup <count>]\n"
+            "Load index from <index> if it exists. Then run several "
+            "cases of benchmarks. The vectors to query are from <query>,"
+            " the groundtruth vectors are from <gt>. Find <k2> nearest"
+            " neighbors for each query vector. The result is consist of "
+            "statistics of latency and recall rate. The recall rate is k1@k2. "
+            "Besides the best, worst and average, percentiles at <percentages> will be "
+            "displayed additionally. For example, if <percentages> = '50,"
+            "99,99.9', then 50-percentile, 99-percentile and "
+            "99.9-percentile of latency and recall rates will be "
+            "displayed. <cases> is a semicolon-split string of serval "
+            "benchmark cases, each is in format of "
+            "[parameters]/<loop>x<batch_size>x<thread_count>[:<cpu-list>] "
+            "(e.g. 'nprobe=32/10x1x4' or 'nprobe=64/10x4x4:0,1,2,3'), "
+            "or of [parameters]/<duration>sx<batch_size>x<thread_count>"
+            "[:<cpu-list>], which passes over the queries until "
+            "<duration> seconds (e.g. 'nprobe=32/30sx1x4'), "
+            "or of [parameters]/<open/fixed>:<rate>qps:<duration>s:"
+            "<thread_count>[x<max_batch>[@<max_wait>us]][:<cpu-list>] "
+            "(e.g. 'nprobe=64/open:5000qps:30s:8'), where single "
+            "queries arrive as a Poisson process (open) or at a fixed "
+            "interval (fixed), or of [parameters]/closed:<clients>c:"
+            "<duration>s:<thread_count>[x<max_batch>[@<max_wait>us]]"
+            "[:<cpu-list>], where each client sends a query after the "
+            "last one returns. The latency of these counts from the "
+            "arrival, and queued queries are searched in batches of up "
+            "to <max_batch> (default 1), once that many are queued or "
+            "the oldest one has waited <max_wait> microseconds "
+            "(e.g. 'nprobe=64/open:5000qps:30s:4x32@500us'). Any case "
+            "may start with <warmup_queries>+ or <warmup_duration>s+ "
+            "after the '/', to search that many queries or seconds in "
+            "batches first and exclude them from the statistics (e.g. "
+            "'nprobe=64/5s+30sx1x4'). [parameters]/mixed:<add_rate>aps:"
+            "<remove_rate>rps:<duration>s:<thread_count>[:<cpu-list>] "
+            "searches single queries for <duration> seconds while a "
+            "writer adds and removes vectors at those rates per second "
+            "(e.g. 'nprobe=64/mixed:100aps:100rps:30s:8'), on a copy of "
+            "the index which should support add_with_ids() and "
+            "remove_ids()\n"
+            "  --gt-distances <dist>  the distances written by "
+            "groundtruth --distances, for the tie-aware recall which "
+            "also counts the neighbors as far as the k1-th one. It is "
+            "also reported if <gt> is an .ibin with the distances "
+            "appended. As the distances returned by the index are used, "
+            "it is only an upper bound for approximate indexes (e.g. PQ, "
+            "SQ)\n"
+            "  --epsilon <epsilon>  relative tolerance of the tie-aware "
+            "recall (default 1e-4)\n"
+            "  --numa  load a replica of <index> on each NUMA node, and "
+            "let each thread search the replica of its node. Threads "
+            "without a cpu-list are spread evenly over the nodes\n"
+            "  --intervals <ms> <file>  write the qps, p50/p99/max "
+            "latency, cpu-util and memory bandwidths of every <ms> "
+            "milliseconds of each case to <file>, as CSV, or as lines of "
+            "JSON if <file> ends with '.json'\n"
+            "  --counters  also output the cycles, instructions, "
+            "LLC loads and misses, dTLB misses and branch misses of the "
+            "searching threads by perf_event_open, in total and per "
+            "query, and the IPC. Those not available are nan\n"
+            "  --writes <vectors> <gt>  the vectors added by mixed cases, "
+            "of ids following the base, and the groundtruth over the "
+            "base and them (e.g. by groundtruth --update). The recall "
+            "of mixed cases is of the index after the writes, against "
+            "the vectors left, and recall-drift is its change\n"
+            "  --tune <recall> <qps/latency>  instead of the statistics, "
+            "tune the parameters of faiss::ParameterSpace not given by "
+            "each case for the highest qps or the lowest P(99%%) latency "
+            "with the average recall at least <recall>, by screening the "
+            "combinations on a sample of the queries and running the "
+            "promising ones as the case. Output the Pareto frontier of "
+            "(recall, qps, p99) and the best of each case, which are only "
+            "reported\n"
+            "  --tune-sample <count>  the count of queries sampled by "
+            "--tune (default 1000)\n"
+            "  --load <read/mmap/mmap-ro>  load <index> by reading it "
+            "(default), or with IO_FLAG_MMAP, or with IO_FLAG_MMAP and "
+            "IO_FLAG_READ_ONLY\n"
+            "  --drop-cache  drop the pages of <index> from the page cache "
+            "by posix_fadvise() before loading it, and output the time "
+            "to load it in milliseconds\n"
+            "  --startup <count>  before the cases, output the time to load "
+            "<index> and to the first query in milliseconds, and the "
+            "latency of the first <count> queries searched one by one "
+            "with the parameters of the first case\n"
+            "%s serve [<socket>]\n"
+            "Keep serving the requests from stdin, or from the "
+            "connections of the Unix socket <socket>, one per line. A "
+            "request is the arguments above, quoted by '' if needed, or "
+            "'size <index>' for the memory size of <index> in KB, or "
+            "'quit'. The response is the output, followed by a line of "
+            "'done', or of 'error: <message>'. The indexes, queries and "
+            "groundtruths are loaded once and kept for later requests, "
+            "and so are the parameters set on the indexes\n",
+            name, name);
+}
+
+// Run the benchmark of the arguments <argv>, with the data kept by <cache>
+// unless it is nullptr. Return false if the arguments are invalid.
+bool Run(int argc, char** argv, Cache* cache) {
+    Options options = {};
+    options.epsilon = 1e-4f;
+    options.tune_sample_count = 1000;
+    bool valid = argc >= 7 && sscanf(argv[4], "%lu@%lu",
+            &options.top_k1, &options.top_k2) == 2 &&
+            options.top_k1 > 0 && options.top_k1 <= options.top_k2;
+    for (int i = 7; valid && i < argc; i++) {
+        if (strcmp(argv[i], "--gt-distances") == 0 && i + 1 < argc) {
+            options.gt_dist_fpath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--numa") == 0) {
+            options.numa = true;
+        }
+        else if (strcmp(argv[i], "--intervals") == 0 && i + 2 < argc) {
+            valid = sscanf(argv[++i], "%lu", &options.interval_ms) == 1 &&
+                    options.interval_ms > 0;
+            options.interval_fpath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--counters") == 0) {
+            options.counting = true;
+        }
+        else if (strcmp(argv[i], "--writes") == 0 && i + 2 < argc) {
+            options.writes_fpath = argv[++i];
+            options.writes_gt_fpath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tune") == 0 && i + 2 < argc) {
+            valid = sscanf(argv[++i], "%f", &options.tune_target) == 1 &&
+                    options.tune_target > 0 && options.tune_target <= 1;
+            i++;
+            if (strcmp(argv[i], "latency") == 0) {
+                options.tune_latency = true;
+            }
+            else if (strcmp(argv[i], "qps") != 0) {
+                valid = false;
+            }
+        }
+        else if (strcmp(argv[i], "--tune-sample") == 0 && i + 1 < argc) {
+            valid = sscanf(argv[++i], "%lu", &options.tune_sample_count) == 1 &&
+                    options.tune_sample_count > 0;
+        }
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "mmap") == 0) {
+                options.io_flags = faiss::IO_FLAG_MMAP;
+            }
+            else if (strcmp(argv[i], "mmap-ro") == 0) {
+                options.io_flags = faiss::IO_FLAG_MMAP |
+                        faiss::IO_FLAG_READ_ONLY;
+            }
+            else if (strcmp(argv[i], "read") != 0) {
+                valid = false;
+            }
+        }
+        else if (strcmp(argv[i], "--drop-cache") == 0) {
+            options.dropping = true;
+        }
+        else if (strcmp(argv[i], "--startup") == 0 && i + 1 < argc) {
+            valid = sscanf(argv[++i], "%lu", &options.startup_count) == 1 &&
+                    options.startup_count > 0;
+        }
+        else if (strcmp(argv[i], "--epsilon") == 0 && i + 1 < argc) {
+            valid = sscanf(argv[++i], "%f", &options.epsilon) == 1 &&
+                    options.epsilon >= 0;
+        }
+        else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        return false;
     }
     const char* index_fpath = argv[1];
     const char* query_fpath = argv[2];
     const char* gt_fpath = argv[3];
     const char* percentages = argv[5];
     const char* cases = argv[6];
+    Benchmark(index_fpath, query_fpath, gt_fpath, percentages, cases, options,
+            cache);
+    return true;
+}
+
+// Split a request into arguments by blanks, except those quoted by '' or "".
+std::vector<std::string> SplitArguments(const std::string& line) {
+    std::vector<std::string> arguments;
+    std::string argument;
+    bool started = false;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            }
+            else {
+                argument.push_back(c);
+            }
+        }
+        else if (c == '\'' || c == '"') {
+            quote = c;
+            started = true;
+        }
+        else if (isspace(c)) {
+            if (started) {
+                arguments.push_back(argument);
+                argument.clear();
+                started = false;
+            }
+        }
+        else {
+            argument.push_back(c);
+            started = true;
+        }
+    }
+    if (quote) {
+        throw std::runtime_error("unmatched quote!");
+    }
+    if (started) {
+        arguments.push_back(argument);
+    }
+    return arguments;
+}
+
+// Handle a request of 'serve', and return false if it is 'quit'. The output
+// is captured into <response>.
+bool Handle(const std::string& line, Cache& cache, std::string& response) {
+    std::ostringstream output;
+    std::streambuf* coutbuf = std::cout.rdbuf(output.rdbuf());
+    bool quit = false;
     try {
-        Benchmark(index_fpath, query_fpath, gt_fpath, top_k1, top_k2, percentages,
-                cases);
+        std::vector<std::string> arguments = SplitArguments(line);
+        std::vector<char*> argv(1, (char*)"benchmark");
+        for (auto it = arguments.begin(); it != arguments.end(); it++) {
+            argv.push_back((char*)it->data());
+        }
+        argv.push_back(nullptr);
+        int argc = argv.size() - 1;
+        if (argc == 2 && arguments[0] == "quit") {
+            quit = true;
+        }
+        else if (argc == 3 && arguments[0] == "size") {
+            OutputValue("size", LoadIndex(argv[2], 0, false, &cache)->size);
+        }
+        else if (!Run(argc, argv.data(), &cache)) {
+            throw std::runtime_error("invalid arguments!");
+        }
+        std::cout << "done" << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cout << "error: " << e.what() << std::endl;
+    }
+    std::cout.rdbuf(coutbuf);
+    response = output.str();
+    return !quit;
+}
+
+// Send <data> to the socket <fd>. Return false if the peer is gone (EPIPE,
+// without SIGPIPE killing the server) or on any other error.
+bool SendAll(int fd, const std::string& data) {
+    for (size_t offset = 0; offset < data.size(); ) {
+        ssize_t ret = send(fd, data.data() + offset, data.size() - offset,
+                MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        offset += ret;
+    }
+    return true;
+}
+
+// Serve the requests from stdin, or from the connections of the Unix socket
+// at <socket_fpath> one after another, until 'quit'.
+void Serve(const char* socket_fpath) {
+    Cache cache;
+    std::string line, response;
+    if (!socket_fpath) {
+        while (std::getline(std::cin, line)) {
+            bool more = Handle(line, cache, response);
+            std::cout << response << std::flush;
+            if (!more) {
+                break;
+            }
+        }
+        return;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_fpath) >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("the path of <socket> is too long!");
+    }
+    strcpy(addr.sun_path, socket_fpath);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        throw std::runtime_error("failed to socket()!");
+    }
+    unlink(socket_fpath);
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(server, 16) != 0) {
+        close(server);
+        throw std::runtime_error(std::string("failed to listen on '")
+                .append(socket_fpath).append("'!"));
+    }
+    bool more = true;
+    while (more) {
+        int fd = accept(server, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        FILE* file = fdopen(fd, "r");
+        if (!file) {
+            close(fd);
+            continue;
+        }
+        char* buf = nullptr;
+        size_t size = 0;
+        ssize_t len;
+        while (more && (len = getline(&buf, &size, file)) >= 0) {
+            line.assign(buf, len);
+            more = Handle(line, cache, response);
+            if (!SendAll(fd, response)) {
+                break;
+            }
+        }
+        free(buf);
+        fclose(file);
+    }
+    close(server);
+    unlink(socket_fpath);
+}
+
+int main(int argc, char** argv) {
+    try {
+        if (argc >= 2 && argc <= 3 && strcmp(argv[1], "serve") == 0) {
+            Serve(argc == 3 ? argv[2] : nullptr);
+        }
+        else if (!Run(argc, argv, nullptr)) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
     }
     catch (const std::exception& e) {
         fprintf(stderr, "ERROR: %s\n", e.what());
@@ -1,172 +1,662 @@
-#include <list>
-#include <mutex>
-#include <queue>
+#include <future>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
+#include <typeinfo>
+#include <exception>
+#include <algorithm>
+#include <stdexcept>
 
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "util/knn.h"
+#include "util/numa.h"
 #include "util/vecs.h"
-#include "util/vector.h"
+#include "util/pipeline.h"
 
-template <typename TBase, typename TQuery, typename TDistance,
-        typename TIndex>
-std::vector<TIndex> Generate(
-        const std::list<std::vector<TBase>>& base_vectors,
-        const std::vector<TQuery>& query_vector,
-        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo,
-        size_t top_n) {
-    size_t count = base_vectors.size();
-    if (top_n > count) {
-        char buf[256];
-        sprintf(buf, "argument <top_n = %lu> is larger than vector count!",
-                count);
-        throw std::runtime_error(buf);
+// Queries searched in one pass over the base. Each thread keeps <top_n>
+// entries for every one of them.
+#define QUERY_BATCH_SIZE        4096
+
+struct Options {
+    const char* metric;
+    size_t top_n;
+    size_t thread_count;
+    // Bytes the base, the queries and the heaps may take, or 0 to load the
+    // whole base into memory.
+    size_t memory;
+    // Seconds between two checkpoints, or 0 for no checkpoint.
+    size_t checkpoint;
+    bool resume;
+    std::string checkpoint_fpath;
+    // Sizes and modification times of <base>, <query> and the previous
+    // ids and distances of --update.
+    uint64_t inputs[8];
+    // Only the base vectors in [base_begin, base_end) are searched, while
+    // the ids stay global.
+    size_t base_begin;
+    size_t base_end;
+    // Id of the first vector in <base>.
+    size_t base_offset;
+    // "interleave" or "replicate" the base over the NUMA nodes, or nullptr.
+    const char* numa;
+};
+
+struct Files {
+    util::vecs::File* gt;
+    util::vecs::File* dist;
+    util::vecs::File* base;
+    util::vecs::File* query;
+    // Ids and distances of a previous run for --update, or nullptr.
+    util::vecs::File* previous_gt;
+    util::vecs::File* previous_dist;
+    // Whether <previous_dist> is an .ibin with the distances appended, as
+    // written by --distances <gt>, opened again.
+    bool previous_appended;
+};
+
+// Progress of a long run, saved into <gt>.ckpt every <options.checkpoint>
+// seconds, so that --resume can continue from there after a crash. It
+// holds the heaps of some queries, the count of queries whose results are
+// final and the count of base vectors already searched.
+template <typename TDistance, typename TIndex>
+class Checkpoint {
+
+public:
+    typedef util::knn::TopK<TDistance, TIndex> Result;
+
+private:
+    static const uint64_t MAGIC = 0x54504b4354472e31;     // "1.GTCKPT"
+
+    std::string fpath;
+    uint64_t signature;
+    size_t top_n;
+    time_t interval;
+    time_t last;
+
+public:
+    // <signature> identifies the arguments and the input files, a
+    // checkpoint of another run is never loaded.
+    Checkpoint(const Options& options, uint64_t _signature) :
+            fpath(options.checkpoint_fpath), signature(_signature),
+            top_n(options.top_n), interval(options.checkpoint),
+            last(time(nullptr)) {}
+
+    bool isEnabled() const {
+        return interval > 0;
     }
-    struct Entry {
-        TIndex index;
-        TDistance distance;
 
-        bool operator <(const Entry& another) const {
-            return distance < another.distance;
+    bool isDue() const {
+        return interval > 0 && time(nullptr) - last >= interval;
+    }
+
+    // Return false if there is no checkpoint.
+    bool load(std::vector<Result>& results, size_t& query_done,
+            size_t& base_done) {
+        FILE* file = fopen(fpath.data(), "rb");
+        if (!file) {
+            return false;
         }
-    };
-    std::priority_queue<Entry> tops;
-    auto iter = base_vectors.begin();
-    for (size_t i = 0; i < count; i++, iter++) {
-        assert(iter != base_vectors.end());
-        Entry entry = {
-            .index = static_cast<TIndex>(i),
-            .distance = dis_algo(*iter, query_vector),
-        };
-        tops.push(entry);
-        if (tops.size() > top_n) {
-            tops.pop();
-        }
-    }
-    assert(tops.size() == top_n);
-    std::vector<TIndex> gt;
-    gt.resize(top_n);
-    size_t rindex = top_n - 1;
-    for (size_t i = 0; i < top_n; i++) {
-        gt[rindex--] = tops.top().index;
-        tops.pop();
-    }
-    return gt;
-}
+        uint64_t header[5];
+        if (fread(header, sizeof(header), 1, file) != 1 ||
+                header[0] != MAGIC) {
+            fclose(file);
+            throw std::runtime_error("broken checkpoint '" + fpath + "'!");
+        }
+        if (header[1] != signature) {
+            fclose(file);
+            throw std::runtime_error("checkpoint '" + fpath +
+                    "' does not match the arguments!");
+        }
+        results.assign(header[4], Result(top_n));
+        std::vector<TDistance> distances;
+        std::vector<TIndex> indices;
+        bool ok = true;
+        for (auto it = results.begin(); ok && it != results.end(); it++) {
+            uint64_t count;
+            ok = fread(&count, sizeof(count), 1, file) == 1 &&
+                    count <= top_n;
+            if (ok) {
+                distances.resize(count);
+                indices.resize(count);
+                ok = fread(distances.data(), sizeof(TDistance), count,
+                        file) == count &&
+                        fread(indices.data(), sizeof(TIndex), count,
+                        file) == count;
+            }
+            for (size_t i = 0; ok && i < count; i++) {
+                it->push(distances[i], indices[i]);
+            }
+        }
+        fclose(file);
+        if (!ok) {
+            throw std::runtime_error("broken checkpoint '" + fpath + "'!");
+        }
+        query_done = header[2];
+        base_done = header[3];
+        return true;
+    }
+
+    // Write into a temporary file first, so that a crash while saving
+    // leaves the previous checkpoint intact.
+    void save(const std::vector<Result>& results, size_t query_done,
+            size_t base_done) {
+        std::string tmp_fpath = fpath + ".tmp";
+        FILE* file = fopen(tmp_fpath.data(), "wb");
+        if (!file) {
+            throw std::runtime_error("cannot open file '" + tmp_fpath +
+                    "'!");
+        }
+        uint64_t header[5] = {MAGIC, signature, query_done, base_done,
+                results.size()};
+        bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+        std::vector<TDistance> distances;
+        std::vector<TIndex> indices;
+        for (auto it = results.begin(); ok && it != results.end(); it++) {
+            const auto& entries = it->getEntries();
+            uint64_t count = entries.size();
+            distances.resize(count);
+            indices.resize(count);
+            for (size_t i = 0; i < count; i++) {
+                distances[i] = entries[i].distance;
+                indices[i] = entries[i].index;
+            }
+            ok = fwrite(&count, sizeof(count), 1, file) == 1 &&
+                    fwrite(distances.data(), sizeof(TDistance), count,
+                    file) == count &&
+                    fwrite(indices.data(), sizeof(TIndex), count,
+                    file) == count;
+        }
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp_fpath.data(), fpath.data()) != 0) {
+            unlink(tmp_fpath.data());
+            throw std::runtime_error("failed to save checkpoint '" + fpath +
+                    "'!");
+        }
+        last = time(nullptr);
+    }
+
+    void remove() {
+        unlink(fpath.data());
+    }
 
+};
+
+// FNV-1a hash of everything a checkpoint depends on.
 template <typename TBase, typename TQuery, typename TDistance,
         typename TIndex>
-std::vector<std::vector<TIndex>> Generate(
-        const std::list<std::vector<TBase>>& base_vectors,
-        const std::list<std::vector<TQuery>>& query_vectors,
-        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo,
-        size_t top_n, size_t thread_count) {
-    if (thread_count == 0) {
-        throw std::runtime_error("<thread_count = 0> is invalid!");
-    }
-    size_t count = query_vectors.size();
-    std::vector<std::vector<TIndex>> gts;
-    gts.resize(count);
-    auto iter = query_vectors.begin();
-    size_t cursor = 0;
-    std::mutex mutex;
-    std::vector<std::thread> threads;
-    for (size_t i = 0; i < thread_count; i++) {
-        threads.emplace_back([&] {
-            while (true) {
-                mutex.lock();
-                size_t index = cursor;
-                if (index >= count) {
-                    mutex.unlock();
-                    break;
-                }
-                assert(iter != query_vectors.end());
-                const std::vector<TQuery>& vector = *iter;
-                iter++;
-                cursor++;
-                mutex.unlock();
-                gts[index] = Generate<TBase, TQuery, TDistance, TIndex>
-                        (base_vectors, vector, dis_algo, top_n);
+uint64_t Signature(const Options& options, size_t dim, bool streaming) {
+    std::string key = std::string(options.metric) + "/" +
+            typeid(TBase).name() + "/" + typeid(TQuery).name() + "/" +
+            typeid(TDistance).name() + "/" + typeid(TIndex).name();
+    uint64_t values[] = {options.top_n, dim, streaming, options.base_begin,
+            options.base_end, options.base_offset};
+    key.append((const char*)values, sizeof(values));
+    key.append((const char*)options.inputs, sizeof(options.inputs));
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++) {
+        hash = (hash ^ (uint8_t)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The results of a previous run, pushed into the heaps before searching,
+// so that only the base vectors appended since then need to be searched.
+template <typename TDistance, typename TIndex>
+class Previous {
+
+private:
+    util::vecs::Formater<TIndex> gt_reader;
+    util::vecs::Formater<float> dist_reader;
+    // For the distances appended to an .ibin, the file, the offset of the
+    // block, its shape and the row to read next.
+    util::vecs::File* block_file;
+    size_t block_offset;
+    size_t rows;
+    size_t columns;
+    size_t row;
+    std::vector<float> block_row;
+
+    const float* viewBlock(size_t& dim) {
+        if (row >= rows) {
+            return nullptr;
+        }
+        block_row.resize(columns);
+        size_t len = sizeof(float) * columns;
+        if (block_file->seek(block_offset + len * row, SEEK_SET) < 0 ||
+                block_file->read(block_row.data(), len) != (ssize_t)len) {
+            throw std::runtime_error("broken file of the previous "
+                    "groundtruth!");
+        }
+        row++;
+        dim = columns;
+        return block_row.data();
+    }
+
+public:
+    Previous(util::vecs::File* gt_file, util::vecs::File* dist_file,
+            bool appended) : gt_reader(gt_file), dist_reader(dist_file),
+            block_file(appended ? dist_file : nullptr), block_offset(0),
+            rows(0), columns(0), row(0) {
+        if (!appended) {
+            return;
+        }
+        util::vecs::Formater<TIndex> reader(dist_file);
+        rows = reader.count();
+        reader.view(columns);
+        block_offset = 2 * sizeof(uint32_t) + sizeof(TIndex) * rows * columns;
+        if (block_file->size() != (ssize_t)(block_offset +
+                sizeof(float) * rows * columns)) {
+            throw std::runtime_error("the previous groundtruth has no "
+                    "distances appended!");
+        }
+    }
+
+    void seek(size_t index) {
+        gt_reader.seek(index);
+        if (block_file) {
+            row = index;
+        }
+        else {
+            dist_reader.seek(index);
+        }
+    }
+
+    // Push the next <count> rows into <results>.
+    void push(util::knn::TopK<TDistance, TIndex>* results, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            size_t gt_dim;
+            size_t dist_dim;
+            const TIndex* ids = gt_reader.view(gt_dim);
+            const float* distances = block_file ? viewBlock(dist_dim) :
+                    dist_reader.view(dist_dim);
+            if (!ids || !distances) {
+                throw std::runtime_error("the previous groundtruth has "
+                        "less queries than <query>!");
+            }
+            if (gt_dim != dist_dim) {
+                throw std::runtime_error("ids and distances of the previous "
+                        "groundtruth do not match!");
+            }
+            for (size_t j = 0; j < gt_dim; j++) {
+                results[i].push(static_cast<TDistance>(distances[j]),
+                        ids[j]);
+            }
+        }
+    }
+
+};
+
+// Copy <base> to every node but the first one, each by a thread bound to
+// the node, and return the copies in the order of <nodes>.
+template <typename T>
+std::vector<const T*> Replicate(const util::knn::Matrix<T>& base,
+        const std::vector<util::numa::Node>& nodes,
+        std::vector<std::unique_ptr<util::knn::Matrix<T>>>& copies) {
+    std::vector<const T*> replicas(1, base.getData());
+    for (size_t i = 1; i < nodes.size(); i++) {
+        copies.emplace_back(new util::knn::Matrix<T>);
+        util::knn::Matrix<T>* copy = copies.back().get();
+        std::exception_ptr error;
+        std::thread thread([&] {
+            try {
+                util::numa::Bind(nodes[i]);
+                copy->allocate(base.getRows(), base.getColumns());
+                memcpy(copy->getData(), base.getData(),
+                        sizeof(T) * base.getRows() * base.getColumns());
+            }
+            catch (...) {
+                error = std::current_exception();
             }
         });
+        thread.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        replicas.push_back(copy->getData());
     }
-    for (size_t i = 0; i < thread_count; i++) {
-        threads[i].join();
+    return replicas;
+}
+
+// Write the ids, and the distances if <dist_writer> is not nullptr. The
+// distances of 'ip' are the negative inner products, so that they always
+// go up along a row.
+template <typename TDistance, typename TIndex>
+void WriteResults(util::vecs::Formater<TIndex>& gt_writer,
+        util::vecs::Formater<float>* dist_writer,
+        std::vector<util::knn::TopK<TDistance, TIndex>>& results,
+        size_t top_n) {
+    std::vector<TIndex> gt(top_n);
+    std::vector<TDistance> distances(top_n);
+    std::vector<float> float_distances(top_n);
+    util::vector::Converter<TDistance, float> converter;
+    for (auto iter = results.begin(); iter != results.end(); iter++) {
+        if (iter->extract(gt.data(), distances.data()) != top_n) {
+            char buf[256];
+            sprintf(buf, "argument <top_n = %lu> is larger than vector "
+                    "count!", top_n);
+            throw std::runtime_error(buf);
+        }
+        gt_writer.write(gt);
+        if (dist_writer) {
+            converter(float_distances.data(), distances.data(), top_n);
+            dist_writer->write(float_distances);
+        }
     }
-    assert(cursor == count);
-    assert(iter == query_vectors.end());
-    return gts;
 }
 
 template <typename TBase, typename TQuery, typename TDistance,
         typename TIndex>
-void Generate(util::vecs::File* gt_file,
-        util::vecs::File* base_file, util::vecs::File* query_file,
-        util::vector::DistanceAlgo<TBase, TQuery, TDistance>& dis_algo,
-        size_t top_n, size_t thread_count) {
-    util::vecs::Formater<TBase> base_reader(base_file);
-    std::list<std::vector<TBase>> base_vectors;
-    while (true) {
-        std::vector<TBase> vector = base_reader.read();
-        if (vector.size() == 0) {
-            break;
+void Generate(const Files& files, const Options& options) {
+    util::knn::Metric metric = util::knn::ParseMetric(options.metric);
+    size_t top_n = options.top_n;
+    util::vecs::Formater<TBase> base_reader(files.base);
+    size_t dim;
+    if (!base_reader.view(dim)) {
+        throw std::runtime_error("empty file of base vectors!");
+    }
+    size_t total = base_reader.count();
+    size_t begin = options.base_begin;
+    if (begin >= total) {
+        throw std::runtime_error("argument <begin> of --base-range is not "
+                "less than vector count!");
+    }
+    size_t count = std::min(options.base_end, total) - begin;
+    if (top_n > count && !files.previous_gt) {
+        char buf[256];
+        sprintf(buf, "argument <top_n = %lu> is larger than vector count!",
+                count);
+        throw std::runtime_error(buf);
+    }
+    base_reader.seek(begin);
+    std::vector<util::numa::Node> nodes;
+    bool replicate = false;
+    if (options.numa) {
+        nodes = util::numa::GetNodes();
+        replicate = strcmp(options.numa, "replicate") == 0;
+    }
+    util::knn::Matrix<TBase> base_vectors;
+    {
+        // The base is either spread over the nodes, or put on the first
+        // one and copied to the others later.
+        std::unique_ptr<util::numa::ScopedPolicy> policy;
+        if (options.numa) {
+            policy.reset(new util::numa::ScopedPolicy(replicate ?
+                    util::numa::PREFERRED : util::numa::INTERLEAVE,
+                    replicate ? std::vector<util::numa::Node>(1, nodes[0]) :
+                    nodes));
         }
-        base_vectors.emplace_back(std::move(vector));
+        base_vectors.allocate(count, dim);
+        if (base_reader.readMatrix(count, dim, base_vectors.getData()) !=
+                count) {
+            throw std::runtime_error("broken file of base vectors!");
+        }
+    }
+    std::vector<std::unique_ptr<util::knn::Matrix<TBase>>> copies;
+    std::vector<const TBase*> replicas;
+    if (replicate) {
+        replicas = Replicate(base_vectors, nodes, copies);
+    }
+    typedef util::knn::BruteForce<TBase, TQuery, TDistance, TIndex> Engine;
+    Engine engine(metric, dim, top_n, options.thread_count);
+    if (options.numa) {
+        engine.bind(nodes);
+    }
+    // The results written so far are kept for the checkpoints, and written
+    // again after resuming.
+    Checkpoint<TDistance, TIndex> checkpoint(options,
+            Signature<TBase, TQuery, TDistance, TIndex>(options, dim, false));
+    std::vector<typename Engine::Result> done;
+    size_t query_done = 0;
+    size_t base_done = 0;
+    if (options.resume) {
+        checkpoint.load(done, query_done, base_done);
+    }
+    std::unique_ptr<Previous<TDistance, TIndex>> previous;
+    if (files.previous_gt) {
+        previous.reset(new Previous<TDistance, TIndex>(files.previous_gt,
+                files.previous_dist, files.previous_appended));
+        previous->seek(query_done);
     }
-    size_t batch_size = thread_count * 1000;
-    util::vecs::Formater<TQuery> query_reader(query_file);
-    util::vecs::Formater<TIndex> gt_writer(gt_file);
+    util::vecs::Formater<TIndex> gt_writer(files.gt);
+    std::unique_ptr<util::vecs::Formater<float>> dist_writer;
+    if (files.dist) {
+        dist_writer.reset(new util::vecs::Formater<float>(files.dist));
+    }
+    std::vector<typename Engine::Result> results(done);
+    WriteResults(gt_writer, dist_writer.get(), results, top_n);
+    util::pipeline::Prefetcher<TQuery, TQuery> query_reader(files.query,
+            dim, QUERY_BATCH_SIZE, 4, query_done);
+    // A batch is written in the background while the next one is searched.
+    std::vector<typename Engine::Result> writing;
+    std::future<void> written;
     while (true) {
-        std::list<std::vector<TQuery>> query_vectors;
-        for (size_t i = 0; i < batch_size; i++) {
-            std::vector<TQuery> vector = query_reader.read();
-            if (vector.size() == 0) {
-                break;
-            }
-            query_vectors.emplace_back(std::move(vector));
-        }
-        if (query_vectors.size() == 0) {
+        size_t query_count;
+        const TQuery* query_vectors = query_reader.next(query_count);
+        if (!query_vectors) {
             break;
         }
-        std::vector<std::vector<TIndex>> gts = Generate
-                <TBase, TQuery, TDistance, TIndex>
-                (base_vectors, query_vectors, dis_algo, top_n, thread_count);
-        for (auto iter = gts.begin(); iter != gts.end(); iter++) {
-            gt_writer.write(*iter);
+        results.assign(query_count, typename Engine::Result(top_n));
+        if (previous) {
+            previous->push(results.data(), query_count);
+        }
+        engine.search(query_vectors, query_count, base_vectors.getData(),
+                count, static_cast<TIndex>(options.base_offset + begin),
+                results.data(), replicas.empty() ? nullptr : replicas.data());
+        if (checkpoint.isEnabled()) {
+            done.insert(done.end(), results.begin(), results.end());
+        }
+        if (written.valid()) {
+            written.get();
         }
+        writing.swap(results);
+        written = std::async(std::launch::async, [&] {
+            WriteResults(gt_writer, dist_writer.get(), writing, top_n);
+        });
+        query_done += query_count;
+        if (checkpoint.isDue()) {
+            checkpoint.save(done, query_done, 0);
+        }
+    }
+    if (written.valid()) {
+        written.get();
+    }
+    gt_writer.finish();
+    if (dist_writer) {
+        dist_writer->finish();
     }
+    checkpoint.remove();
 }
 
+// For bases larger than the memory: all the queries and their heaps stay
+// in memory, while the base is streamed through in chunks, two of them in
+// flight so that reading overlaps the computation.
 template <typename TBase, typename TQuery, typename TDistance,
         typename TIndex>
-void Generate(util::vecs::File* gt_file,
-        util::vecs::File* base_file, util::vecs::File* query_file,
-        const char* metric_type, size_t top_n, size_t thread_count) {
-    std::unique_ptr<util::vector::DistanceAlgo<TBase, TQuery, TDistance>> algo;
-    if (strcmp(metric_type, "l1") == 0) {
-        algo.reset(new util::vector::DistanceL1<TBase, TQuery, TDistance>);
+void GenerateStreaming(const Files& files, const Options& options) {
+    util::knn::Metric metric = util::knn::ParseMetric(options.metric);
+    size_t top_n = options.top_n;
+    // The queries, heaps and chunks are all spread over the nodes.
+    std::vector<util::numa::Node> nodes;
+    std::unique_ptr<util::numa::ScopedPolicy> policy;
+    if (options.numa) {
+        if (strcmp(options.numa, "interleave") != 0) {
+            throw std::runtime_error("--numa replicate does not work with "
+                    "--memory!");
+        }
+        nodes = util::numa::GetNodes();
+        policy.reset(new util::numa::ScopedPolicy(util::numa::INTERLEAVE,
+                nodes));
+    }
+    util::vecs::Formater<TQuery> query_reader(files.query);
+    size_t dim;
+    if (!query_reader.view(dim)) {
+        throw std::runtime_error("empty file of query vectors!");
+    }
+    size_t query_count = query_reader.count();
+    query_reader.reset();
+    util::knn::Matrix<TQuery> queries(query_count, dim);
+    if (query_reader.readMatrix(query_count, dim, queries.getData()) !=
+            query_count) {
+        throw std::runtime_error("broken file of query vectors!");
+    }
+    typedef util::knn::BruteForce<TBase, TQuery, TDistance, TIndex> Engine;
+    typedef typename Engine::Result::Entry Entry;
+    size_t batch_size = std::min<size_t>(QUERY_BATCH_SIZE, query_count);
+    size_t fixed = query_count * dim * sizeof(TQuery) +
+            query_count * top_n * sizeof(Entry) +
+            options.thread_count * batch_size * top_n * sizeof(Entry) +
+            batch_size * dim * sizeof(float);
+    size_t chunk_size = options.memory > fixed ?
+            (options.memory - fixed) / (2 * dim * sizeof(TBase)) : 0;
+    if (chunk_size == 0) {
+        char buf[256];
+        sprintf(buf, "memory budget is too small, %lu bytes are needed "
+                "besides the base!", fixed);
+        throw std::runtime_error(buf);
+    }
+    Engine engine(metric, dim, top_n, options.thread_count);
+    if (options.numa) {
+        engine.bind(nodes);
     }
-    else if (strcmp(metric_type, "l2") == 0) {
-        algo.reset(new util::vector::DistanceL2Sqr<TBase, TQuery, TDistance>);
+    Checkpoint<TDistance, TIndex> checkpoint(options,
+            Signature<TBase, TQuery, TDistance, TIndex>(options, dim, true));
+    std::vector<typename Engine::Result> results(query_count,
+            typename Engine::Result(top_n));
+    size_t query_done = 0;
+    size_t count = 0;
+    if (options.resume && checkpoint.load(results, query_done, count)) {
+        if (results.size() != query_count) {
+            throw std::runtime_error("checkpoint does not match the "
+                    "queries!");
+        }
     }
-    else if (strcmp(metric_type, "ip") == 0) {
-        algo.reset(new util::vector::DistanceIP<TBase, TQuery, TDistance>);
+    else if (files.previous_gt) {
+        Previous<TDistance, TIndex> previous(files.previous_gt,
+                files.previous_dist, files.previous_appended);
+        previous.push(results.data(), query_count);
+    }
+    size_t begin = options.base_begin;
+    size_t end = options.base_end;
+    util::pipeline::Prefetcher<TBase, TBase> base_reader(files.base, dim,
+            chunk_size, 2, begin + count);
+    while (begin + count < end) {
+        size_t chunk_count;
+        const TBase* chunk = base_reader.next(chunk_count);
+        if (!chunk) {
+            break;
+        }
+        chunk_count = std::min(chunk_count, end - begin - count);
+        for (size_t i = 0; i < query_count; i += batch_size) {
+            engine.search(queries.getRow(i),
+                    std::min(batch_size, query_count - i), chunk,
+                    chunk_count,
+                    static_cast<TIndex>(options.base_offset + begin + count),
+                    results.data() + i);
+        }
+        count += chunk_count;
+        if (checkpoint.isDue()) {
+            checkpoint.save(results, 0, count);
+        }
+    }
+    if (count == 0) {
+        throw std::runtime_error("empty file of base vectors!");
+    }
+    util::vecs::Formater<TIndex> gt_writer(files.gt);
+    std::unique_ptr<util::vecs::Formater<float>> dist_writer;
+    if (files.dist) {
+        dist_writer.reset(new util::vecs::Formater<float>(files.dist));
+    }
+    WriteResults(gt_writer, dist_writer.get(), results, top_n);
+    gt_writer.finish();
+    if (dist_writer) {
+        dist_writer->finish();
+    }
+    checkpoint.remove();
+}
+
+template <typename TBase, typename TQuery, typename TDistance,
+        typename TIndex>
+void Dispatch(const Files& files, const Options& options) {
+    if (options.memory) {
+        GenerateStreaming<TBase, TQuery, TDistance, TIndex>(files, options);
     }
     else {
-        throw std::runtime_error(std::string("unsupported metric type: '")
-                .append(metric_type).append("'!"));
+        Generate<TBase, TQuery, TDistance, TIndex>(files, options);
     }
-    Generate<TBase, TQuery, TDistance, TIndex>(gt_file, base_file,
-            query_file, *algo, top_n, thread_count);
 }
 
-void Generate(const char* gt_fpath, const char* base_fpath,
-        const char* query_fpath, const char* metric_type,
-        size_t top_n, size_t thread_count) {
+void Generate(const char* gt_fpath, const char* dist_fpath,
+        const char* base_fpath, const char* query_fpath,
+        const char* previous_gt_fpath, const char* previous_dist_fpath,
+        Options options) {
+    const char* fpaths[] = {base_fpath, query_fpath, previous_gt_fpath,
+            previous_dist_fpath};
+    for (size_t i = 0; i < 4 && fpaths[i]; i++) {
+        struct stat st;
+        if (stat(fpaths[i], &st) != 0) {
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpaths[i]).append("'!"));
+        }
+        options.inputs[i * 2] = st.st_size;
+        options.inputs[i * 2 + 1] = st.st_mtime;
+        // Opening the outputs truncates them, before the inputs are read.
+        const char* outputs[] = {gt_fpath, dist_fpath};
+        for (size_t j = 0; j < 2; j++) {
+            struct stat out_st;
+            if (outputs[j] && stat(outputs[j], &out_st) == 0 &&
+                    out_st.st_dev == st.st_dev &&
+                    out_st.st_ino == st.st_ino) {
+                throw std::runtime_error(std::string("output '")
+                        .append(outputs[j]).append("' is the input '")
+                        .append(fpaths[i]).append("'!"));
+            }
+        }
+    }
+    options.checkpoint_fpath = std::string(gt_fpath) + ".ckpt";
     util::vecs::SuffixWrapper base(base_fpath, true);
     util::vecs::SuffixWrapper query(query_fpath, true);
     util::vecs::SuffixWrapper gt(gt_fpath, false);
-    typedef void (*func_t)(
-            util::vecs::File*, util::vecs::File*, util::vecs::File*,
-            const char*, size_t, size_t);
+    std::unique_ptr<util::vecs::SuffixWrapper> dist;
+    if (dist_fpath) {
+        dist.reset(new util::vecs::SuffixWrapper(dist_fpath, false));
+        if (dist->getDataType() != 'f') {
+            throw std::runtime_error("the file of distances should be "
+                    ".fvecs or .fbin!");
+        }
+    }
+    std::unique_ptr<util::vecs::SuffixWrapper> previous_gt;
+    std::unique_ptr<util::vecs::SuffixWrapper> previous_dist;
+    // <old_dist> = <old_gt> means the distances appended to <old_gt>.
+    bool previous_appended = previous_gt_fpath &&
+            strcmp(previous_gt_fpath, previous_dist_fpath) == 0;
+    if (previous_gt_fpath) {
+        previous_gt.reset(new util::vecs::SuffixWrapper(previous_gt_fpath,
+                true));
+        previous_dist.reset(new util::vecs::SuffixWrapper(
+                previous_dist_fpath, true));
+        if (previous_gt->getDataType() != gt.getDataType()) {
+            throw std::runtime_error("the previous groundtruth should be "
+                    "of the same format as <gt>!");
+        }
+        if (previous_appended ? !previous_dist->getFile()->isDense() :
+                previous_dist->getDataType() != 'f') {
+            throw std::runtime_error("the previous distances should be "
+                    "in .fvecs or .fbin, or appended to <old_gt> of .ibin!");
+        }
+    }
+    Files files = {gt.getFile(), dist ? dist->getFile() : nullptr,
+            base.getFile(), query.getFile(),
+            previous_gt ? previous_gt->getFile() : nullptr,
+            previous_dist ? previous_dist->getFile() : nullptr,
+            previous_appended};
+    typedef void (*func_t)(const Files&, const Options&);
     static const struct Entry {
         char base_type;
         char query_type;
@@ -174,37 +664,126 @@ void Generate(const char* gt_fpath, const char* base_fpath,
         func_t func;
     }
     entries[] = {
-        {'c', 'f', 'i', Generate<int8_t, float, float, int32_t>},
-        {'c', 'c', 'i', Generate<int8_t, int8_t, int64_t, int32_t>},
-        {'b', 'b', 'i', Generate<uint8_t, uint8_t, int64_t, int32_t>},
-        {'b', 'i', 'i', Generate<uint8_t, int32_t, int64_t, int32_t>},
-        {'b', 'f', 'i', Generate<uint8_t, float, float, int32_t>},
-        {'i', 'b', 'i', Generate<int32_t, uint8_t, int64_t, int32_t>},
-        {'i', 'i', 'i', Generate<int32_t, int32_t, int64_t, int32_t>},
-        {'i', 'f', 'i', Generate<int32_t, float, float, int32_t>},
-        {'f', 'b', 'i', Generate<float, uint8_t, float, int32_t>},
-        {'f', 'i', 'i', Generate<float, int32_t, float, int32_t>},
-        {'f', 'f', 'i', Generate<float, float, float, int32_t>},
+        {'c', 'f', 'i', Dispatch<int8_t, float, float, int32_t>},
+        {'c', 'c', 'i', Dispatch<int8_t, int8_t, int64_t, int32_t>},
+        {'b', 'b', 'i', Dispatch<uint8_t, uint8_t, int64_t, int32_t>},
+        {'b', 'i', 'i', Dispatch<uint8_t, int32_t, int64_t, int32_t>},
+        {'b', 'f', 'i', Dispatch<uint8_t, float, float, int32_t>},
+        {'i', 'b', 'i', Dispatch<int32_t, uint8_t, int64_t, int32_t>},
+        {'i', 'i', 'i', Dispatch<int32_t, int32_t, int64_t, int32_t>},
+        {'i', 'f', 'i', Dispatch<int32_t, float, float, int32_t>},
+        {'f', 'b', 'i', Dispatch<float, uint8_t, float, int32_t>},
+        {'f', 'i', 'i', Dispatch<float, int32_t, float, int32_t>},
+        {'f', 'f', 'i', Dispatch<float, float, float, int32_t>},
     };
     for (size_t i = 0; i < sizeof(entries) / sizeof(Entry); i++) {
         const Entry* entry = entries + i;
         if (base.getDataType() == entry->base_type &&
                 query.getDataType() == entry->query_type &&
                 gt.getDataType() == entry->gt_type) {
-            entry->func(gt.getFile(), base.getFile(), query.getFile(),
-                    metric_type, top_n, thread_count);
+            entry->func(files, options);
             return;
         }
     }
     throw std::runtime_error("unsupported format!");
 }
 
+// Move the distances in <dist_fpath> (a .fbin) to the end of <gt_fpath> (an
+// .ibin), making the layout of big-ann-benchmarks: a header of count and
+// top_n, the ids, and then the distances.
+void AppendDistances(const char* gt_fpath, const char* dist_fpath) {
+    std::unique_ptr<FILE, int (*)(FILE*)> src(fopen(dist_fpath, "rb"),
+            fclose);
+    std::unique_ptr<FILE, int (*)(FILE*)> dst(fopen(gt_fpath, "ab"), fclose);
+    if (!src || !dst || fseek(src.get(), 2 * sizeof(uint32_t),
+            SEEK_SET) != 0) {
+        throw std::runtime_error("failed to append the distances!");
+    }
+    std::vector<char> buffer(1 << 20);
+    size_t len;
+    while ((len = fread(buffer.data(), 1, buffer.size(), src.get())) > 0) {
+        if (fwrite(buffer.data(), 1, len, dst.get()) != len) {
+            throw std::runtime_error("failed to append the distances!");
+        }
+    }
+    if (ferror(src.get()) || fflush(dst.get()) != 0) {
+        throw std::runtime_error("failed to append the distances!");
+    }
+    src.reset();
+    unlink(dist_fpath);
+}
+
+// Parse sizes like "512M" or "64G".
+bool ParseSize(const char* str, size_t& size) {
+    char unit = 0;
+    int count = sscanf(str, "%lu%c", &size, &unit);
+    if (count == 1) {
+        return true;
+    }
+    if (count != 2) {
+        return false;
+    }
+    const char* units = "KMGT";
+    const char* pos = strchr(units, toupper(unit));
+    if (!pos || !*pos || str[strlen(str) - 1] != unit) {
+        return false;
+    }
+    for (const char* p = units; p <= pos; p++) {
+        size <<= 10;
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
-    size_t top_n;
-    size_t thread_count;
-    if (argc != 7 || sscanf(argv[5], "%lu", &top_n) != 1 ||
-            sscanf(argv[6], "%lu", &thread_count) != 1) {
-        fprintf(stderr, "%s <gt> <base> <query> <metric> <top_n> <thread>\n"
+    Options options = {};
+    options.base_end = SIZE_MAX;
+    const char* dist = nullptr;
+    const char* previous_gt = nullptr;
+    const char* previous_dist = nullptr;
+    bool valid = argc >= 7 && sscanf(argv[5], "%lu", &options.top_n) == 1 &&
+            sscanf(argv[6], "%lu", &options.thread_count) == 1;
+    for (int i = 7; valid && i < argc; i++) {
+        if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            valid = ParseSize(argv[++i], options.memory) &&
+                    options.memory > 0;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            valid = sscanf(argv[++i], "%lu", &options.checkpoint) == 1 &&
+                    options.checkpoint > 0;
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            options.resume = true;
+        }
+        else if (strcmp(argv[i], "--base-range") == 0 && i + 1 < argc) {
+            valid = sscanf(argv[++i], "%lu:%lu", &options.base_begin,
+                    &options.base_end) == 2 &&
+                    options.base_begin < options.base_end;
+        }
+        else if (strcmp(argv[i], "--distances") == 0 && i + 1 < argc) {
+            dist = argv[++i];
+        }
+        else if (strcmp(argv[i], "--update") == 0 && i + 2 < argc) {
+            previous_gt = argv[++i];
+            previous_dist = argv[++i];
+        }
+        else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+            options.numa = argv[++i];
+            valid = strcmp(options.numa, "interleave") == 0 ||
+                    strcmp(options.numa, "replicate") == 0;
+        }
+        else if (strcmp(argv[i], "--base-offset") == 0 && i + 1 < argc) {
+            valid = sscanf(argv[++i], "%lu", &options.base_offset) == 1;
+        }
+        else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "%s <gt> <base> <query> <metric> <top_n> <thread> "
+                "[--memory <size>] [--checkpoint <seconds>] [--resume] "
+                "[--base-range <begin>:<end>] [--distances <dist>] "
+                "[--update <old_gt> <old_dist>] [--base-offset <offset>] "
+                "[--numa <interleave/replicate>]\n"
                 "Calculate the groundtruth for vectors in <query>. "
                 "For each vector in <query>, find the <top_n> nearest vectors"
                 " from <base>. Output result to <gt>. Use <metric> to "
@@ -212,17 +791,51 @@ int main(int argc, char** argv) {
                 "are supported. "
                 "Accelerate the process with <thread> threads. "
                 "The formats of <base> and <query> can be any combination "
-                "of .[b/i/f]vecs.(gz). While the format of <gt> should be "
-                ".ivecs or .ivecs.gz.\n",
+                "of .[c/b/i/f]vecs.(gz/bgz) and .[i8/u8/i/f]bin. While the "
+                "format of <gt> should be .ivecs.(gz/bgz) or .ibin.\n"
+                "  --memory <size>  stream <base> in chunks, keeping the "
+                "memory usage under <size> (e.g. 512M, 64G)\n"
+                "  --checkpoint <seconds>  save the progress into <gt>.ckpt "
+                "every <seconds> seconds\n"
+                "  --resume  continue from <gt>.ckpt if it exists\n"
+                "  --base-range <begin>:<end>  only search the base vectors "
+                "[<begin>, <end>), still with their global ids\n"
+                "  --distances <dist>  also write the distances into <dist>, "
+                "a .fvecs(.gz/bgz) or .fbin file, or append them to <gt> "
+                "of .ibin if <dist> is <gt>\n"
+                "  --update <old_gt> <old_dist>  start from the ids and "
+                "distances of a previous run, so that <base> only needs "
+                "the newly appended vectors. <old_dist> may be <old_gt> "
+                "of .ibin with the distances appended\n"
+                "  --base-offset <offset>  the id of the first vector in "
+                "<base>, usually the vector count of the previous base\n"
+                "  --numa <interleave/replicate>  bind the threads evenly to "
+                "the NUMA nodes, and interleave the base over the nodes, or "
+                "copy it to each node (not with --memory)\n",
                 argv[0]);
         return 1;
     }
     const char* gt = argv[1];
     const char* base = argv[2];
     const char* query = argv[3];
-    const char* metric = argv[4];
+    options.metric = argv[4];
     try {
-        Generate(gt, base, query, metric, top_n, thread_count);
+        // --distances <gt> appends the distances to <gt> when it is done.
+        std::string block_fpath;
+        if (dist && strcmp(dist, gt) == 0) {
+            size_t len = strlen(gt);
+            if (len < 5 || strcmp(gt + len - 5, ".ibin") != 0) {
+                throw std::runtime_error("distances can only be appended "
+                        "to <gt> of .ibin!");
+            }
+            block_fpath = std::string(gt) + ".dist.fbin";
+            dist = block_fpath.c_str();
+        }
+        Generate(gt, dist, base, query, previous_gt, previous_dist,
+                options);
+        if (!block_fpath.empty()) {
+            AppendDistances(gt, block_fpath.c_str());
+        }
     }
     catch (const std::exception& e) {
         fprintf(stderr, "ERROR: %s\n", e.what());
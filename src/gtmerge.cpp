@@ -0,0 +1,143 @@
+#include <memory>
+#include <vector>
+#include <stdexcept>
+
+#include "util/knn.h"
+#include "util/vecs.h"
+
+template <typename TIndex>
+void Merge(util::vecs::File* gt_file, util::vecs::File* dist_file,
+        const std::vector<util::vecs::File*>& shard_gt_files,
+        const std::vector<util::vecs::File*>& shard_dist_files,
+        size_t top_n) {
+    size_t shard_count = shard_gt_files.size();
+    std::vector<std::unique_ptr<util::vecs::Formater<TIndex>>> gt_readers;
+    std::vector<std::unique_ptr<util::vecs::Formater<float>>> dist_readers;
+    for (size_t i = 0; i < shard_count; i++) {
+        gt_readers.emplace_back(
+                new util::vecs::Formater<TIndex>(shard_gt_files[i]));
+        dist_readers.emplace_back(
+                new util::vecs::Formater<float>(shard_dist_files[i]));
+    }
+    util::vecs::Formater<TIndex> gt_writer(gt_file);
+    std::unique_ptr<util::vecs::Formater<float>> dist_writer;
+    if (dist_file) {
+        dist_writer.reset(new util::vecs::Formater<float>(dist_file));
+    }
+    // Ties are broken by the id, the same as groundtruth does.
+    util::knn::TopK<float, TIndex> tops(top_n);
+    std::vector<TIndex> gt(top_n);
+    std::vector<float> distances(top_n);
+    while (true) {
+        size_t ended = 0;
+        for (size_t i = 0; i < shard_count; i++) {
+            size_t gt_dim;
+            size_t dist_dim;
+            const TIndex* ids = gt_readers[i]->view(gt_dim);
+            const float* dists = dist_readers[i]->view(dist_dim);
+            if (!ids && !dists) {
+                ended++;
+                continue;
+            }
+            if (!ids || !dists || gt_dim != dist_dim) {
+                throw std::runtime_error("ids and distances of a shard "
+                        "do not match!");
+            }
+            for (size_t j = 0; j < gt_dim; j++) {
+                tops.push(dists[j], ids[j]);
+            }
+        }
+        if (ended == shard_count) {
+            break;
+        }
+        if (ended) {
+            throw std::runtime_error("shards have different counts of "
+                    "queries!");
+        }
+        if (tops.size() < top_n) {
+            char buf[256];
+            sprintf(buf, "argument <top_n = %lu> is larger than the count "
+                    "of neighbors in the shards!", top_n);
+            throw std::runtime_error(buf);
+        }
+        tops.extract(gt.data(), distances.data());
+        gt_writer.write(gt);
+        if (dist_writer) {
+            dist_writer->write(distances);
+        }
+    }
+    gt_writer.finish();
+    if (dist_writer) {
+        dist_writer->finish();
+    }
+}
+
+void Merge(const char* gt_fpath, const char* dist_fpath,
+        const std::vector<const char*>& shard_fpaths, size_t top_n) {
+    std::vector<std::unique_ptr<util::vecs::SuffixWrapper>> shards;
+    std::vector<util::vecs::File*> shard_gt_files;
+    std::vector<util::vecs::File*> shard_dist_files;
+    for (size_t i = 0; i < shard_fpaths.size(); i++) {
+        shards.emplace_back(new util::vecs::SuffixWrapper(shard_fpaths[i],
+                true));
+        char type = shards.back()->getDataType();
+        if (type != (i % 2 ? 'f' : 'i')) {
+            throw std::runtime_error("unsupported format!");
+        }
+        (i % 2 ? shard_dist_files : shard_gt_files).push_back(
+                shards.back()->getFile());
+    }
+    util::vecs::SuffixWrapper gt(gt_fpath, false);
+    std::unique_ptr<util::vecs::SuffixWrapper> dist;
+    if (dist_fpath) {
+        dist.reset(new util::vecs::SuffixWrapper(dist_fpath, false));
+        if (dist->getDataType() != 'f') {
+            throw std::runtime_error("the file of distances should be "
+                    ".fvecs or .fbin!");
+        }
+    }
+    if (gt.getDataType() != 'i') {
+        throw std::runtime_error("unsupported format!");
+    }
+    Merge<int32_t>(gt.getFile(), dist ? dist->getFile() : nullptr,
+            shard_gt_files, shard_dist_files, top_n);
+}
+
+int main(int argc, char** argv) {
+    size_t top_n;
+    const char* dist = nullptr;
+    std::vector<const char*> shards;
+    bool valid = argc >= 5 && sscanf(argv[2], "%lu", &top_n) == 1;
+    for (int i = 3; valid && i < argc; i++) {
+        if (strcmp(argv[i], "--distances") == 0 && i + 1 < argc) {
+            dist = argv[++i];
+        }
+        else {
+            shards.push_back(argv[i]);
+        }
+    }
+    if (!valid || shards.empty() || shards.size() % 2 != 0) {
+        fprintf(stderr, "%s <gt> <top_n> <shard_gt> <shard_dist> "
+                "[<shard_gt> <shard_dist> ...] [--distances <dist>]\n"
+                "Merge the groundtruths of several shards of the base, "
+                "produced by 'groundtruth --base-range <begin>:<end> "
+                "--distances <shard_dist>', into the <top_n> nearest "
+                "neighbors of the whole base, and output them to <gt>. "
+                "The format of <gt> and <shard_gt> should be "
+                ".ivecs.(gz/bgz) or .ibin, while the format of <dist> and "
+                "<shard_dist> should be .fvecs.(gz/bgz) or .fbin.\n"
+                "  --distances <dist>  also write the merged distances "
+                "into <dist>\n",
+                argv[0]);
+        return 1;
+    }
+    const char* gt = argv[1];
+    try {
+        Merge(gt, dist, shards, top_n);
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include "util/vecs.h"
 #include "util/random.h"
 #include "util/vector.h"
+#include "util/pipeline.h"
 #include "util/perfmon.h"
 
 template <typename T>
@@ -12,59 +13,45 @@ std::shared_ptr<faiss::Index> Build(const char* key, faiss::MetricType metric,
         const char* parameters, util::vecs::File* base_file,
         float train_ratio, size_t add_batch_size) {
     util::vecs::Formater<T> reader(base_file);
-    size_t dim = reader.read().size();
+    size_t dim;
+    reader.view(dim);
     if (dim == 0) {
         throw std::runtime_error("empty file of base vectors!");
     }
-    size_t base_count = 1;
-    while (reader.skip()) {
-        base_count++;
-    }
-    reader.reset();
+    size_t base_count = reader.count();
     size_t train_count = std::min<>(base_count,
             std::max<>(1UL, (size_t)(base_count * train_ratio)));
     float* train_vectors = new float[dim * train_count];
-    std::unique_ptr<float> vectors_deleter(train_vectors);
-    size_t cursor = 0;
+    std::unique_ptr<float[]> vectors_deleter(train_vectors);
     util::random::Sequence<size_t> seq_rand(0, base_count, train_count);
     util::vector::Converter<T, float> converter;
     for (size_t i = 0; i < train_count; i++) {
-        size_t index = seq_rand.next();
-        while (cursor < index) {
-            reader.skip();
-            cursor++;
+        reader.seek(seq_rand.next());
+        size_t vdim;
+        const T* vector = reader.view(vdim);
+        if (vdim != dim) {
+            char buf[256];
+            sprintf(buf, "index is %luD, but this vector is %luD!",
+                    dim, vdim);
+            throw std::runtime_error(buf);
         }
-        assert(cursor == index);
-        std::vector<T> vector = reader.read();
-        cursor++;
-        converter(train_vectors + dim * i, vector);
+        converter(train_vectors + dim * i, vector, dim);
     }
-    assert(cursor <= base_count);
     reader.reset();
     std::shared_ptr<faiss::Index> index(faiss::index_factory(dim, key,
             metric));
     faiss::ParameterSpace().set_index_parameters(index.get(), parameters);
     index->train(train_count, train_vectors);
-    float* add_batch = new float[dim * add_batch_size];
-    vectors_deleter.reset(add_batch);
-    size_t current_batch_size = 0;
-    for (size_t i = 0; i < base_count; i++) {
-        std::vector<T> vector = reader.read();
-        if (vector.size() != dim) {
-            char buf[256];
-            sprintf(buf, "index is %luD, but this vector is %luD!",
-                    dim, vector.size());
-            throw std::runtime_error(buf);
+    vectors_deleter.reset();
+    util::pipeline::Prefetcher<T, float> prefetcher(base_file, dim,
+            add_batch_size);
+    while (true) {
+        size_t count;
+        const float* add_batch = prefetcher.next(count);
+        if (!add_batch) {
+            break;
         }
-        converter(add_batch + dim * current_batch_size, vector);
-        current_batch_size++;
-        if (current_batch_size == add_batch_size) {
-            index->add(add_batch_size, add_batch);
-            current_batch_size = 0;
-        }
-    }
-    if (current_batch_size) {
-        index->add(current_batch_size, add_batch);
+        index->add(count, add_batch);
     }
     return index;
 }
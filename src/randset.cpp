@@ -16,6 +16,7 @@ void Generate(util::vecs::File* file, size_t dim, size_t count,
         }
         writer.write(vector);
     }
+    writer.finish();
 }
 
 void Generate(const char* fpath, size_t dim, size_t count,
@@ -27,6 +28,7 @@ void Generate(const char* fpath, size_t dim, size_t count,
         func_t func;
     }
     entries[] = {
+        {'c', Generate<int8_t, std::uniform_int_distribution<int8_t>>},
         {'b', Generate<uint8_t, std::uniform_int_distribution<uint8_t>>},
         {'i', Generate<int32_t, std::uniform_int_distribution<int32_t>>},
         {'f', Generate<float, std::uniform_real_distribution<float>>},
@@ -51,11 +53,12 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%s <dst> <dim> <n> <min> <max>\n"
                 "Generate a random dataset with <n> vectors and save to "
                 "<dst>. Each vector is <dim>-dimension, and each dimension "
-                "is in type of uint8_t, int32_t or float, up to <dst>. "
-                "For example, if <dst> is 'base.fvecs', then the type is "
-                "float. The formats of <dst> can be any combination of "
-                ".[b/i/f]vecs.(gz). The value of each dimension is in "
-                "[min, max].\n",
+                "is in type of int8_t, uint8_t, int32_t or float, up to "
+                "<dst>. For example, if <dst> is 'base.fvecs', then the "
+                "type is float. The formats of <dst> can be any combination"
+                " of .[c/b/i/f]vecs.(gz/bgz) or .[i8/u8/i/f]bin, where .gz "
+                "is written in BGZF blocks like .bgz, compressed in "
+                "parallel. The value of each dimension is in [min, max].\n",
                 argv[0]);
         return 1;
     }
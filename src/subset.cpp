@@ -6,34 +6,27 @@ template <typename TSrc, typename TDst>
 void Extract(util::vecs::File* src_file, util::vecs::File* dst_file,
         size_t count) {
     util::vecs::Formater<TSrc> reader(src_file);
-    size_t icount = 0;
-    while (reader.skip()) {
-        icount++;
-    }
+    size_t icount = reader.count();
     if (count > icount) {
         char buf[256];
         sprintf(buf, "argument <count = %lu> is larger than vector count!",
                 count);
         throw std::runtime_error(buf);
     }
-    reader.reset();
-    size_t cursor = 0;
     util::random::Sequence<size_t> seq_rand(0, icount, count);
     util::vecs::Formater<TDst> writer(dst_file);
     util::vector::Converter<TSrc, TDst> converter;
+    std::vector<TDst> vector;
     for (size_t i = 0; i < count; i++) {
-        size_t index = seq_rand.next();
-        while (cursor < index) {
-            reader.skip();
-            cursor++;
-        }
-        assert(cursor == index);
-        std::vector<TSrc> vector = reader.read();
-        cursor++;
-        assert(vector.size() > 0);
-        writer.write(converter(vector));
+        reader.seek(seq_rand.next());
+        size_t dim;
+        const TSrc* src = reader.view(dim);
+        assert(src && dim > 0);
+        vector.resize(dim);
+        converter(vector.data(), src, dim);
+        writer.write(vector);
     }
-    assert(cursor <= icount);
+    writer.finish();
 }
 
 void Extract(const char* src_fpath, const char* dst_fpath, size_t count) {
@@ -46,12 +39,17 @@ void Extract(const char* src_fpath, const char* dst_fpath, size_t count) {
         func_t func;
     }
     entries[] = {
+        {'c', 'c', Extract<int8_t, int8_t>},
+        {'c', 'i', Extract<int8_t, int32_t>},
+        {'c', 'f', Extract<int8_t, float>},
         {'b', 'b', Extract<uint8_t, uint8_t>},
         {'b', 'i', Extract<uint8_t, int32_t>},
         {'b', 'f', Extract<uint8_t, float>},
+        {'i', 'c', Extract<int32_t, int8_t>},
         {'i', 'b', Extract<int32_t, uint8_t>},
         {'i', 'i', Extract<int32_t, int32_t>},
         {'i', 'f', Extract<int32_t, float>},
+        {'f', 'c', Extract<float, int8_t>},
         {'f', 'b', Extract<float, uint8_t>},
         {'f', 'i', Extract<float, int32_t>},
         {'f', 'f', Extract<float, float>},
@@ -73,7 +71,9 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%s <src> <dst> <n>\n"
                 "Extract <n> vectors randomly from <src> to <dst>. "
                 "The formats of <src> and <dst> can be any combination of"
-                " .[b/i/f]vecs.(gz).\n",
+                " .[c/b/i/f]vecs.(gz/bgz) and .[i8/u8/i/f]bin, where .gz is "
+                "written in BGZF blocks like .bgz, compressed in parallel."
+                "\n",
                 argv[0]);
         return 1;
     }
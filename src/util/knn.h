@@ -0,0 +1,536 @@
+#ifndef UTIL_KNN_H
+#define UTIL_KNN_H
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_BLAS
+#include <cblas.h>
+#endif
+
+#include "numa.h"
+#include "simd.h"
+#include "vector.h"
+
+namespace util {
+
+namespace knn {
+
+enum Metric {
+    L1,
+    L2,
+    IP,
+};
+
+inline Metric ParseMetric(const char* name) {
+    if (strcmp(name, "l1") == 0) {
+        return L1;
+    }
+    if (strcmp(name, "l2") == 0) {
+        return L2;
+    }
+    if (strcmp(name, "ip") == 0) {
+        return IP;
+    }
+    throw std::runtime_error(std::string("unsupported metric type: '")
+            .append(name).append("'!"));
+}
+
+// A row-major matrix in one 64-byte aligned block.
+template <typename T>
+class Matrix {
+
+private:
+    T* data;
+    size_t rows;
+    size_t columns;
+
+public:
+    Matrix() : data(nullptr), rows(0), columns(0) {}
+
+    Matrix(size_t _rows, size_t _columns) : Matrix() {
+        allocate(_rows, _columns);
+    }
+
+    Matrix(const Matrix&) = delete;
+
+    Matrix& operator =(const Matrix&) = delete;
+
+    ~Matrix() {
+        free(data);
+    }
+
+    // Drop the content and make room for <_rows> x <_columns> elements.
+    void allocate(size_t _rows, size_t _columns) {
+        free(data);
+        data = nullptr;
+        rows = 0;
+        columns = 0;
+        size_t bytes = _rows * _columns * sizeof(T);
+        if (bytes) {
+            void* ptr;
+            if (posix_memalign(&ptr, 64, bytes) != 0) {
+                throw std::bad_alloc();
+            }
+            data = static_cast<T*>(ptr);
+        }
+        rows = _rows;
+        columns = _columns;
+    }
+
+    T* getData() {
+        return data;
+    }
+
+    const T* getData() const {
+        return data;
+    }
+
+    T* getRow(size_t index) {
+        return data + index * columns;
+    }
+
+    const T* getRow(size_t index) const {
+        return data + index * columns;
+    }
+
+    size_t getRows() const {
+        return rows;
+    }
+
+    size_t getColumns() const {
+        return columns;
+    }
+
+};
+
+// The <k> nearest entries pushed so far, kept in a max-heap.
+template <typename TDistance, typename TIndex>
+class TopK {
+
+public:
+    struct Entry {
+        TDistance distance;
+        TIndex index;
+
+        // Ties are broken by the index, so that the result does not depend
+        // on the order of pushes.
+        bool operator <(const Entry& another) const {
+            return distance < another.distance ||
+                    (distance == another.distance && index < another.index);
+        }
+    };
+
+private:
+    std::vector<Entry> heap;
+    size_t k;
+
+public:
+    explicit TopK(size_t _k = 0) : k(_k) {
+        heap.reserve(k);
+    }
+
+    size_t size() const {
+        return heap.size();
+    }
+
+    // The entries in heap order.
+    const std::vector<Entry>& getEntries() const {
+        return heap;
+    }
+
+    void push(TDistance distance, TIndex index) {
+        Entry entry = {distance, index};
+        if (heap.size() < k) {
+            heap.push_back(entry);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        else if (k && entry < heap.front()) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = entry;
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    void merge(const TopK& another) {
+        for (auto it = another.heap.begin(); it != another.heap.end(); it++) {
+            push(it->distance, it->index);
+        }
+    }
+
+    void clear() {
+        heap.clear();
+    }
+
+    // Move the entries out, the nearest first. <distances> may be nullptr.
+    size_t extract(TIndex* indices, TDistance* distances) {
+        std::sort_heap(heap.begin(), heap.end());
+        size_t count = heap.size();
+        for (size_t i = 0; i < count; i++) {
+            indices[i] = heap[i].index;
+            if (distances) {
+                distances[i] = heap[i].distance;
+            }
+        }
+        heap.clear();
+        return count;
+    }
+
+};
+
+// Threads kept alive between the calls of run(), so that short jobs do not
+// pay for creating and joining threads.
+class ThreadPool {
+
+private:
+    std::vector<std::thread> threads;
+    std::function<void(size_t)> func;
+    size_t generation;
+    size_t pending;
+    bool stopping;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable done;
+
+public:
+    explicit ThreadPool(size_t count) : generation(0), pending(0),
+            stopping(false) {
+        for (size_t i = 1; i < count; i++) {
+            threads.emplace_back([this, i] {
+                work(i);
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator =(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            cond.notify_all();
+        }
+        for (auto it = threads.begin(); it != threads.end(); it++) {
+            it->join();
+        }
+    }
+
+    size_t size() const {
+        return threads.size() + 1;
+    }
+
+    // Call <_func>(i) for every i < size(), the 0-th in the calling thread,
+    // and return when all of them are done. The first exception thrown is
+    // rethrown here.
+    void run(const std::function<void(size_t)>& _func) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            func = _func;
+            error = nullptr;
+            pending = threads.size();
+            generation++;
+            cond.notify_all();
+        }
+        call(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pending) {
+            done.wait(lock);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    void work(size_t index) {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!stopping && generation == seen) {
+                    cond.wait(lock);
+                }
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            call(index);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                done.notify_all();
+            }
+        }
+    }
+
+    void call(size_t index) {
+        try {
+            func(index);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+};
+
+// Exact k-NN by brute force. The base is scanned in tiles small enough to
+// stay in the cache while every query is computed against them. Float L2
+// and IP distances come from the norms and blocked inner products (sgemm
+// with USE_BLAS), the others from the exact per-pair kernels.
+template <typename TBase, typename TQuery, typename TDistance,
+        typename TIndex>
+class BruteForce {
+
+public:
+    typedef TopK<TDistance, TIndex> Result;
+
+private:
+    typedef TDistance (*func_t)(const TBase*, const TQuery*, size_t);
+
+    // Buffers of a worker for the blocked tiles.
+    struct Workspace {
+        Matrix<float> tile;
+        std::vector<float> norms;
+        std::vector<float> products;
+    };
+
+    static const size_t TILE_BYTES = 1 << 18;
+    static const size_t QUERY_BLOCK = 64;
+
+    Metric metric;
+    size_t dim;
+    size_t top_n;
+    size_t thread_count;
+    size_t tile_rows;
+    bool blocked;
+    func_t func;
+    Matrix<float> float_queries;
+    std::vector<float> query_norms;
+    ThreadPool pool;
+    std::vector<Workspace> workspaces;
+    std::vector<std::vector<Result>> locals;
+    // Index in the nodes passed to bind() of each worker.
+    std::vector<size_t> worker_nodes;
+
+public:
+    BruteForce(Metric _metric, size_t _dim, size_t _top_n,
+            size_t _thread_count) : metric(_metric), dim(_dim),
+            top_n(_top_n), thread_count(_thread_count),
+            pool(_thread_count), workspaces(_thread_count),
+            locals(_thread_count), worker_nodes(_thread_count, 0) {
+        if (dim == 0) {
+            throw std::runtime_error("<dim = 0> is invalid!");
+        }
+        if (thread_count == 0) {
+            throw std::runtime_error("<thread_count = 0> is invalid!");
+        }
+        tile_rows = std::max<size_t>(16, TILE_BYTES / (dim * sizeof(float)));
+        blocked = std::is_same<TDistance, float>::value && metric != L1;
+        typedef simd::Distance<TBase, TQuery, TDistance> Distance;
+        func = metric == L1 ? Distance::L1 :
+                metric == L2 ? Distance::L2Sqr : Distance::IP;
+        for (size_t i = 0; i < thread_count; i++) {
+            prepare(workspaces[i]);
+        }
+    }
+
+    // Spread the workers evenly over <nodes>, each bound to the CPUs of its
+    // node and allocating from it. The calling thread, which is the 0-th
+    // worker, keeps its own affinity and memory policy, so that what the
+    // caller allocates afterwards is still placed as it chose. It reads the
+    // copy of the first node.
+    void bind(const std::vector<numa::Node>& nodes) {
+        pool.run([&](size_t i) {
+            worker_nodes[i] = i * nodes.size() / thread_count;
+            if (i > 0) {
+                numa::Bind(nodes[worker_nodes[i]]);
+            }
+        });
+    }
+
+    // Push the distances between every query and the base rows into
+    // <results>, one per query. Base row i gets the id <base_offset> + i.
+    // If <replicas> is not nullptr, it holds a copy of <base> for each node
+    // passed to bind(), and the workers read the copies of their nodes.
+    void search(const TQuery* queries, size_t query_count,
+            const TBase* base, size_t base_count, TIndex base_offset,
+            Result* results, const TBase* const* replicas = nullptr) {
+        if (blocked) {
+            float_queries.allocate(query_count, dim);
+            vector::Converter<TQuery, float> converter;
+            converter(float_queries.getData(), queries, query_count * dim);
+            query_norms.resize(query_count);
+            for (size_t i = 0; i < query_count; i++) {
+                const float* query = float_queries.getRow(i);
+                query_norms[i] = simd::Distance<float, float, float>::IP(
+                        query, query, dim);
+            }
+        }
+        size_t tile_count = (base_count + tile_rows - 1) / tile_rows;
+        size_t workers = std::min(thread_count, tile_count);
+        if (workers <= 1) {
+            if (replicas) {
+                base = replicas[worker_nodes[0]];
+            }
+            for (size_t i = 0; i < tile_count; i++) {
+                scan(queries, query_count, base, base_count, base_offset,
+                        results, i, workspaces[0]);
+            }
+            return;
+        }
+        // Each worker owns a contiguous range of tiles and pushes into its
+        // own heaps. A worker done with its range steals tiles from the
+        // ranges of the others, so no lock is taken while scanning.
+        std::unique_ptr<Range[]> ranges(new Range[workers]);
+        for (size_t i = 0; i < workers; i++) {
+            ranges[i].next = tile_count * i / workers;
+            ranges[i].end = tile_count * (i + 1) / workers;
+            locals[i].resize(query_count, Result(top_n));
+        }
+        pool.run([&](size_t i) {
+            if (i >= workers) {
+                return;
+            }
+            for (size_t j = 0; j < workers; j++) {
+                Range& range = ranges[(i + j) % workers];
+                while (true) {
+                    size_t tile = range.next++;
+                    if (tile >= range.end) {
+                        break;
+                    }
+                    scan(queries, query_count,
+                            replicas ? replicas[worker_nodes[i]] : base,
+                            base_count, base_offset, locals[i].data(), tile,
+                            workspaces[i]);
+                }
+            }
+        });
+        // The heaps are merged in parallel as well, each thread taking a
+        // contiguous range of queries.
+        size_t mergers = pool.size();
+        pool.run([&](size_t i) {
+            size_t end = query_count * (i + 1) / mergers;
+            for (size_t j = query_count * i / mergers; j < end; j++) {
+                for (size_t k = 0; k < workers; k++) {
+                    results[j].merge(locals[k][j]);
+                    locals[k][j].clear();
+                }
+            }
+        });
+    }
+
+private:
+    struct Range {
+        std::atomic<size_t> next;
+        size_t end;
+    };
+
+    void prepare(Workspace& workspace) {
+        if (blocked) {
+            if (!std::is_same<TBase, float>::value) {
+                workspace.tile.allocate(tile_rows, dim);
+            }
+            workspace.norms.resize(tile_rows);
+            workspace.products.resize(QUERY_BLOCK * tile_rows);
+        }
+    }
+
+    void scan(const TQuery* queries, size_t query_count, const TBase* base,
+            size_t base_count, TIndex base_offset, Result* results,
+            size_t tile, Workspace& workspace) {
+        size_t begin = tile * tile_rows;
+        size_t rows = std::min(tile_rows, base_count - begin);
+        const TBase* tile_base = base + begin * dim;
+        TIndex tile_offset = base_offset + static_cast<TIndex>(begin);
+        if (!blocked) {
+            scanPairs(queries, query_count, tile_base, rows, tile_offset,
+                    results);
+            return;
+        }
+        const float* float_base = reinterpret_cast<const float*>(tile_base);
+        if (!std::is_same<TBase, float>::value) {
+            vector::Converter<TBase, float> converter;
+            converter(workspace.tile.getData(), tile_base, rows * dim);
+            float_base = workspace.tile.getData();
+        }
+        float* norms = workspace.norms.data();
+        for (size_t i = 0; i < rows; i++) {
+            const float* row = float_base + i * dim;
+            norms[i] = simd::Distance<float, float, float>::IP(row, row, dim);
+        }
+        float* products = workspace.products.data();
+        for (size_t q = 0; q < query_count; q += QUERY_BLOCK) {
+            size_t block = std::min(QUERY_BLOCK, query_count - q);
+            const float* query_block = float_queries.getRow(q);
+#ifdef USE_BLAS
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, block, rows,
+                    dim, 1.0f, query_block, dim, float_base, dim, 0.0f,
+                    products, rows);
+#else
+            simd::InnerProducts(query_block, block, float_base, rows, dim,
+                    products);
+#endif
+            for (size_t i = 0; i < block; i++) {
+                const float* row = products + i * rows;
+                Result& result = results[q + i];
+                float query_norm = query_norms[q + i];
+                for (size_t j = 0; j < rows; j++) {
+                    float distance = metric == IP ? -row[j] :
+                            std::max(query_norm + norms[j] - 2 * row[j],
+                            0.0f);
+                    result.push(static_cast<TDistance>(distance),
+                            tile_offset + static_cast<TIndex>(j));
+                }
+            }
+        }
+    }
+
+    void scanPairs(const TQuery* queries, size_t query_count,
+            const TBase* base, size_t rows, TIndex base_offset,
+            Result* results) {
+        for (size_t q = 0; q < query_count; q += QUERY_BLOCK) {
+            size_t block = std::min(QUERY_BLOCK, query_count - q);
+            for (size_t j = 0; j < rows; j++) {
+                const TBase* row = base + j * dim;
+                TIndex index = base_offset + static_cast<TIndex>(j);
+                for (size_t i = 0; i < block; i++) {
+                    TDistance distance = func(row, queries + (q + i) * dim,
+                            dim);
+                    if (metric == IP) {
+                        distance = -distance;
+                    }
+                    results[q + i].push(distance, index);
+                }
+            }
+        }
+    }
+
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef UTIL_NUMA_H
+#define UTIL_NUMA_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/syscall.h>
+
+#define UTIL_NUMA_NODE_PATH     "/sys/devices/system/node"
+
+namespace util {
+
+namespace numa {
+
+// Modes of set_mempolicy(2), so that libnuma is not needed.
+enum Policy {
+    DEFAULT = 0,
+    PREFERRED = 1,
+    BIND = 2,
+    INTERLEAVE = 3,
+};
+
+static const int MAX_NODES = 1024;
+
+struct Node {
+    int id;
+    // Empty if the CPUs are unknown, then threads are not bound.
+    std::vector<int> cpus;
+};
+
+// Parse a list like "0-3,8,10-11".
+inline bool ParseList(const char* str, std::vector<int>& values) {
+    values.clear();
+    while (*str && *str != '\n') {
+        char* end;
+        long first = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return false;
+        }
+        long last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return false;
+            }
+        }
+        for (long i = first; i <= last; i++) {
+            values.push_back(i);
+        }
+        str = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+inline bool ReadList(const std::string& fpath, std::vector<int>& values) {
+    FILE* file = fopen(fpath.c_str(), "r");
+    if (!file) {
+        return false;
+    }
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), file) && ParseList(buf, values);
+    fclose(file);
+    return ok;
+}
+
+// Return the online nodes having CPUs. Without NUMA (or /sys), the whole
+// machine is one node.
+inline std::vector<Node> GetNodes() {
+    std::vector<Node> nodes;
+    std::vector<int> ids;
+    if (ReadList(UTIL_NUMA_NODE_PATH "/online", ids)) {
+        for (auto it = ids.begin(); it != ids.end(); it++) {
+            Node node;
+            node.id = *it;
+            char fpath[256];
+            sprintf(fpath, UTIL_NUMA_NODE_PATH "/node%d/cpulist", *it);
+            if (*it < MAX_NODES && ReadList(fpath, node.cpus) &&
+                    !node.cpus.empty()) {
+                nodes.push_back(node);
+            }
+        }
+    }
+    if (nodes.empty()) {
+        Node node;
+        node.id = 0;
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+// Set the policy of the calling thread for the pages it touches from now
+// on, over <nodes> (ignored for DEFAULT).
+inline void SetPolicy(Policy policy, const std::vector<Node>& nodes) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    const size_t bits = 8 * sizeof(unsigned long);
+    for (auto it = nodes.begin(); it != nodes.end(); it++) {
+        mask[it->id / bits] |= 1UL << (it->id % bits);
+    }
+    long ret = policy == DEFAULT ?
+            syscall(SYS_set_mempolicy, policy, nullptr, 0) :
+            syscall(SYS_set_mempolicy, policy, mask, MAX_NODES);
+    if (ret != 0) {
+        throw std::runtime_error("set_mempolicy() failed!");
+    }
+}
+
+// Set a policy of the calling thread until the end of the scope.
+class ScopedPolicy {
+
+private:
+    std::vector<Node> nodes;
+
+public:
+    ScopedPolicy(Policy policy, const std::vector<Node>& _nodes) :
+            nodes(_nodes) {
+        SetPolicy(policy, nodes);
+    }
+
+    ScopedPolicy(const ScopedPolicy&) = delete;
+
+    ScopedPolicy& operator =(const ScopedPolicy&) = delete;
+
+    ~ScopedPolicy() {
+        try {
+            SetPolicy(DEFAULT, nodes);
+        }
+        catch (const std::exception& e) {
+        }
+    }
+
+};
+
+// Run the calling thread on the CPUs of <node>, and allocate from it.
+inline void Bind(const Node& node) {
+    if (node.cpus.empty()) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto it = node.cpus.begin(); it != node.cpus.end(); it++) {
+        CPU_SET(*it, &cpus);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        throw std::runtime_error("failed to pthread_setaffinity_np()");
+    }
+    SetPolicy(PREFERRED, std::vector<Node>(1, node));
+}
+
+// Return the index in <nodes> of the node having <cpu>, or 0 if unknown.
+inline size_t FindNode(const std::vector<Node>& nodes, int cpu) {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const std::vector<int>& cpus = nodes[i].cpus;
+        for (auto it = cpus.begin(); it != cpus.end(); it++) {
+            if (*it == cpu) {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+}
+
+}
+
+#endif
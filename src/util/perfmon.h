@@ -1,6 +1,7 @@
 #ifndef UTIL_PERFMON_H
 #define UTIL_PERFMON_H
 
+#include <cmath>
 #include <mutex>
 #include <thread>
 #include <cassert>
@@ -12,7 +13,12 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
 
 #ifdef USE_PCM
 #include <cpucounters.h>
@@ -36,6 +42,16 @@ public:
         return tv.tv_sec * 1000000 + tv.tv_usec;
     }
 
+    // A monotonic clock of nanoseconds for short intervals, not slewed by
+    // NTP.
+    static uint64_t nanosecond() {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0) {
+            throw std::runtime_error("clock_gettime() failed!");
+        }
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
 };
 
 class CPUUtilization {
@@ -167,6 +183,112 @@ private:
     }
 };
 
+// Hardware counters of the calling thread by perf_event_open(2), in user
+// space only, so that neither root nor PCM is needed as long as
+// perf_event_paranoid <= 2. The events are opened separately rather than as
+// a group, and scaled if the kernel multiplexes them. An event unsupported
+// by the CPU (or forbidden) reads NaN.
+class HardwareCounters {
+
+public:
+    enum Event {
+        CYCLES,
+        INSTRUCTIONS,
+        LLC_LOADS,
+        LLC_MISSES,
+        DTLB_MISSES,
+        BRANCH_MISSES,
+        EVENT_COUNT,
+    };
+
+private:
+    int fds[EVENT_COUNT];
+
+public:
+    HardwareCounters() {
+        static const struct Entry {
+            uint32_t type;
+            uint64_t config;
+        }
+        entries[EVENT_COUNT] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+        for (int i = 0; i < EVENT_COUNT; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = entries[i].type;
+            attr.config = entries[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                    PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+
+    HardwareCounters(const HardwareCounters&) = delete;
+
+    HardwareCounters& operator =(const HardwareCounters&) = delete;
+
+    ~HardwareCounters() {
+        for (int i = 0; i < EVENT_COUNT; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+    }
+
+    static const char* name(Event event) {
+        static const char* names[EVENT_COUNT] = {"cycles", "instructions",
+                "llc-loads", "llc-misses", "dtlb-misses", "branch-misses"};
+        return names[event];
+    }
+
+    void start() {
+        for (int i = 0; i < EVENT_COUNT; i++) {
+            if (fds[i] >= 0) {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void end(double (&values)[EVENT_COUNT]) {
+        for (int i = 0; i < EVENT_COUNT; i++) {
+            values[i] = NAN;
+            if (fds[i] < 0) {
+                continue;
+            }
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            // The value, the time enabled and the time running.
+            uint64_t data[3];
+            if (read(fds[i], data, sizeof(data)) != sizeof(data)) {
+                continue;
+            }
+            if (data[2] > 0) {
+                values[i] = (double)data[0] * data[1] / data[2];
+            }
+            else if (data[0] == 0) {
+                values[i] = 0;
+            }
+        }
+    }
+
+};
+
 #ifdef USE_PCM
 template <typename T>
 class PCMInstanceFakeTemplate {
@@ -232,6 +354,9 @@ private:
     float total_time;
     float read_bandwidth;
     float write_bandwidth;
+    float last_read_bandwidth;
+    float last_write_bandwidth;
+    std::mutex mutex;
     std::thread* thread;
     volatile bool running;
 
@@ -247,6 +372,8 @@ public:
         total_time = 0.0f;
         read_bandwidth = 0.0f;
         write_bandwidth = 0.0f;
+        last_read_bandwidth = NAN;
+        last_write_bandwidth = NAN;
         running = true;
         thread = new std::thread([&] {
             while (running) {
@@ -267,6 +394,14 @@ public:
         w_bw = write_bandwidth;
     }
 
+    // The bandwidths of the latest sample (about a second) while running,
+    // or NaN before the first one.
+    void glance(float& r_bw, float& w_bw) {
+        std::lock_guard<std::mutex> lock(mutex);
+        r_bw = last_read_bandwidth;
+        w_bw = last_write_bandwidth;
+    }
+
 private:
     void update() {
         uint64_t new_time = Clock::microsecond();
@@ -280,6 +415,11 @@ private:
         uint64_t writes = getBytesWrittenToMC(*prev_state, *now_state);
         float sudden_r_bw = reads / time_delta;
         float sudden_w_bw = writes / time_delta;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last_read_bandwidth = sudden_r_bw;
+            last_write_bandwidth = sudden_w_bw;
+        }
         total_time += time_delta;
         float k = time_delta / total_time;
         float nk = 1.0 - k;
@@ -301,6 +441,11 @@ public:
         w_bw = NAN;
     }
 
+    void glance(float& r_bw, float& w_bw) {
+        r_bw = NAN;
+        w_bw = NAN;
+    }
+
 };
 #endif
 
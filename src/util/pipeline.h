@@ -0,0 +1,145 @@
+#ifndef UTIL_PIPELINE_H
+#define UTIL_PIPELINE_H
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "vecs.h"
+
+namespace util {
+
+namespace pipeline {
+
+// Read vectors of TSrc from a file in a background thread, and convert them
+// into batches of TDst, each holding up to <batch_size> vectors of <dim>
+// dimensions in a contiguous array. At most <depth> batches are read ahead,
+// so reading and decompressing overlap with the consumer's computation.
+// Reading starts from the <begin>-th vector.
+template <typename TSrc, typename TDst>
+class Prefetcher {
+
+private:
+    struct Batch {
+        std::vector<TDst> data;
+        size_t count;
+    };
+
+    vecs::Formater<TSrc> reader;
+    size_t dim;
+    size_t batch_size;
+    size_t begin;
+    std::vector<Batch> batches;
+    size_t head;
+    size_t tail;
+    bool lent;
+    bool finished;
+    bool stopping;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+
+public:
+    Prefetcher(vecs::File* file, size_t _dim, size_t _batch_size,
+            size_t depth = 4, size_t _begin = 0) : reader(file), dim(_dim),
+            batch_size(_batch_size), begin(_begin), head(0), tail(0),
+            lent(false), finished(false), stopping(false) {
+        if (batch_size == 0) {
+            throw std::runtime_error("<batch_size = 0> is invalid!");
+        }
+        if (depth == 0) {
+            throw std::runtime_error("<depth = 0> is invalid!");
+        }
+        batches.resize(depth);
+        for (auto it = batches.begin(); it != batches.end(); it++) {
+            it->data.resize(dim * batch_size);
+            it->count = 0;
+        }
+        thread = std::thread([this] {
+            produce();
+        });
+    }
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            cond.notify_all();
+        }
+        thread.join();
+    }
+
+    // Return the next batch and its vector count, or nullptr at the end.
+    // The batch stays valid until the next call.
+    const TDst* next(size_t& count) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (lent) {
+            head++;
+            lent = false;
+            cond.notify_all();
+        }
+        while (head == tail && !finished && !error) {
+            cond.wait(lock);
+        }
+        if (head == tail) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            count = 0;
+            return nullptr;
+        }
+        lent = true;
+        const Batch& batch = batches[head % batches.size()];
+        count = batch.count;
+        return batch.data.data();
+    }
+
+private:
+    void produce() {
+        try {
+            if (begin) {
+                reader.seek(begin);
+            }
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!stopping && tail - head == batches.size()) {
+                    cond.wait(lock);
+                }
+                if (stopping) {
+                    return;
+                }
+                Batch& batch = batches[tail % batches.size()];
+                lock.unlock();
+                batch.count = reader.readMatrix(batch_size, dim,
+                        batch.data.data());
+                lock.lock();
+                if (batch.count) {
+                    tail++;
+                }
+                if (batch.count < batch_size) {
+                    finished = true;
+                }
+                cond.notify_all();
+                if (finished) {
+                    return;
+                }
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            cond.notify_all();
+        }
+    }
+
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,782 @@
+#ifndef UTIL_SIMD_H
+#define UTIL_SIMD_H
+
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Highest instruction set to use: 0 for scalar, 1 for AVX2, 2 for AVX-512
+// and 3 for AVX-512 VNNI. The actual level is also limited by the CPU.
+#ifndef UTIL_SIMD_MAX_LEVEL
+#define UTIL_SIMD_MAX_LEVEL     3
+#endif
+
+namespace util {
+
+namespace simd {
+
+enum Level {
+    SCALAR = 0,
+    AVX2 = 1,
+    AVX512 = 2,
+    AVX512_VNNI = 3,
+};
+
+inline Level DetectLevel() {
+    int level = SCALAR;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = AVX2;
+        if (__builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx512bw")) {
+            level = AVX512;
+            if (__builtin_cpu_supports("avx512vnni")) {
+                level = AVX512_VNNI;
+            }
+        }
+    }
+#endif
+    return (Level)std::min(level, UTIL_SIMD_MAX_LEVEL);
+}
+
+inline Level GetLevel() {
+    static const Level level = DetectLevel();
+    return level;
+}
+
+// Pick the implementation for the current level. A null entry falls back
+// to the one of the level below.
+template <typename TFunc>
+TFunc Select(TFunc scalar, TFunc avx2, TFunc avx512, TFunc vnni) {
+    TFunc funcs[] = {scalar, avx2, avx512, vnni};
+    for (int level = GetLevel(); level > SCALAR; level--) {
+        if (funcs[level]) {
+            return funcs[level];
+        }
+    }
+    return scalar;
+}
+
+// Plain implementations, each element is converted to TResult first.
+template <typename TV1, typename TV2, typename TResult>
+struct Scalar {
+
+    static TResult L1(const TV1* v1, const TV2* v2, size_t dim) {
+        TResult sum = 0;
+        for (size_t i = 0; i < dim; i++) {
+            TResult delta = static_cast<TResult>(v1[i]) -
+                    static_cast<TResult>(v2[i]);
+            sum += std::abs(delta);
+        }
+        return sum;
+    }
+
+    static TResult L2Sqr(const TV1* v1, const TV2* v2, size_t dim) {
+        TResult sum = 0;
+        for (size_t i = 0; i < dim; i++) {
+            TResult delta = static_cast<TResult>(v1[i]) -
+                    static_cast<TResult>(v2[i]);
+            sum += delta * delta;
+        }
+        return sum;
+    }
+
+    static TResult IP(const TV1* v1, const TV2* v2, size_t dim) {
+        TResult sum = 0;
+        for (size_t i = 0; i < dim; i++) {
+            sum += static_cast<TResult>(v1[i]) *
+                    static_cast<TResult>(v2[i]);
+        }
+        return sum;
+    }
+
+};
+
+// Distance<TV1, TV2, TResult>::L1/L2Sqr/IP compute the distance between two
+// vectors with the fastest implementation for the CPU. IP is the plain
+// inner product.
+template <typename TV1, typename TV2, typename TResult,
+        typename TEnable = void>
+struct Distance : Scalar<TV1, TV2, TResult> {};
+
+#if defined(__x86_64__)
+
+// GCC warns about the undefined registers inside the AVX-512 intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#define UTIL_SIMD_AVX2      __attribute__((target("avx2,fma")))
+#define UTIL_SIMD_AVX512    __attribute__((target("avx2,fma,avx512f,"   \
+        "avx512bw")))
+#define UTIL_SIMD_VNNI      __attribute__((target("avx2,fma,avx512f,"   \
+        "avx512bw,avx512vnni")))
+
+// Integer kernels accumulate in 32-bit lanes, and flush them into 64 bits
+// every INT_BLOCK elements, long before the lanes could overflow.
+static const size_t INT_BLOCK = 1 << 15;
+
+/* Float kernels. Integer elements are converted to float on the fly, so
+ * the results are the same as the scalar ones up to rounding. */
+
+UTIL_SIMD_AVX2 inline __m256 Load8(const float* p) {
+    return _mm256_loadu_ps(p);
+}
+
+UTIL_SIMD_AVX2 inline __m256 Load8(const uint8_t* p) {
+    __m128i v = _mm_loadl_epi64((const __m128i*)p);
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+}
+
+UTIL_SIMD_AVX2 inline __m256 Load8(const int8_t* p) {
+    __m128i v = _mm_loadl_epi64((const __m128i*)p);
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v));
+}
+
+UTIL_SIMD_AVX2 inline __m256 Load8(const int32_t* p) {
+    return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)p));
+}
+
+UTIL_SIMD_AVX2 inline float Sum8(__m256 v) {
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(v),
+            _mm256_extractf128_ps(v, 1));
+    x = _mm_hadd_ps(x, x);
+    x = _mm_hadd_ps(x, x);
+    return _mm_cvtss_f32(x);
+}
+
+UTIL_SIMD_AVX512 inline __m512 Load16(const float* p) {
+    return _mm512_loadu_ps(p);
+}
+
+UTIL_SIMD_AVX512 inline __m512 Load16(const uint8_t* p) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(v));
+}
+
+UTIL_SIMD_AVX512 inline __m512 Load16(const int8_t* p) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(v));
+}
+
+UTIL_SIMD_AVX512 inline __m512 Load16(const int32_t* p) {
+    return _mm512_cvtepi32_ps(_mm512_loadu_si512(p));
+}
+
+template <typename TV1, typename TV2>
+UTIL_SIMD_AVX2 float L1FloatAvx2(const TV1* v1, const TV2* v2, size_t dim) {
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        __m256 delta = _mm256_sub_ps(Load8(v1 + i), Load8(v2 + i));
+        sum = _mm256_add_ps(sum, _mm256_and_ps(delta, mask));
+    }
+    return Sum8(sum) + Scalar<TV1, TV2, float>::L1(v1 + i, v2 + i, dim - i);
+}
+
+template <typename TV1, typename TV2>
+UTIL_SIMD_AVX2 float L2SqrFloatAvx2(const TV1* v1, const TV2* v2,
+        size_t dim) {
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        __m256 delta = _mm256_sub_ps(Load8(v1 + i), Load8(v2 + i));
+        sum = _mm256_fmadd_ps(delta, delta, sum);
+    }
+    return Sum8(sum) +
+            Scalar<TV1, TV2, float>::L2Sqr(v1 + i, v2 + i, dim - i);
+}
+
+template <typename TV1, typename TV2>
+UTIL_SIMD_AVX2 float IPFloatAvx2(const TV1* v1, const TV2* v2, size_t dim) {
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        sum = _mm256_fmadd_ps(Load8(v1 + i), Load8(v2 + i), sum);
+    }
+    return Sum8(sum) + Scalar<TV1, TV2, float>::IP(v1 + i, v2 + i, dim - i);
+}
+
+template <typename TV1, typename TV2>
+UTIL_SIMD_AVX512 float L1FloatAvx512(const TV1* v1, const TV2* v2,
+        size_t dim) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m512 delta = _mm512_sub_ps(Load16(v1 + i), Load16(v2 + i));
+        sum = _mm512_add_ps(sum, _mm512_abs_ps(delta));
+    }
+    return _mm512_reduce_add_ps(sum) +
+            L1FloatAvx2(v1 + i, v2 + i, dim - i);
+}
+
+template <typename TV1, typename TV2>
+UTIL_SIMD_AVX512 float L2SqrFloatAvx512(const TV1* v1, const TV2* v2,
+        size_t dim) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m512 delta = _mm512_sub_ps(Load16(v1 + i), Load16(v2 + i));
+        sum = _mm512_fmadd_ps(delta, delta, sum);
+    }
+    return _mm512_reduce_add_ps(sum) +
+            L2SqrFloatAvx2(v1 + i, v2 + i, dim - i);
+}
+
+template <typename TV1, typename TV2>
+UTIL_SIMD_AVX512 float IPFloatAvx512(const TV1* v1, const TV2* v2,
+        size_t dim) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        sum = _mm512_fmadd_ps(Load16(v1 + i), Load16(v2 + i), sum);
+    }
+    return _mm512_reduce_add_ps(sum) + IPFloatAvx2(v1 + i, v2 + i, dim - i);
+}
+
+/* 8-bit integer kernels, exact. */
+
+UTIL_SIMD_AVX2 inline __m256i Widen16(const uint8_t* p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+UTIL_SIMD_AVX2 inline __m256i Widen16(const int8_t* p) {
+    return _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+UTIL_SIMD_AVX2 inline int64_t Sum32x8(__m256i v) {
+    __m256i x = _mm256_add_epi64(
+            _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)),
+            _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    __m128i y = _mm_add_epi64(_mm256_castsi256_si128(x),
+            _mm256_extracti128_si256(x, 1));
+    return _mm_cvtsi128_si64(y) + _mm_extract_epi64(y, 1);
+}
+
+UTIL_SIMD_AVX2 inline int64_t Sum64x4(__m256i v) {
+    __m128i y = _mm_add_epi64(_mm256_castsi256_si128(v),
+            _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(y) + _mm_extract_epi64(y, 1);
+}
+
+UTIL_SIMD_AVX512 inline __m512i Widen32(const uint8_t* p) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p));
+}
+
+UTIL_SIMD_AVX512 inline __m512i Widen32(const int8_t* p) {
+    return _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)p));
+}
+
+UTIL_SIMD_AVX512 inline int64_t Sum32x16(__m512i v) {
+    __m512i x = _mm512_add_epi64(
+            _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)),
+            _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+    return _mm512_reduce_add_epi64(x);
+}
+
+// Flip the sign bit of every byte. It maps int8_t to uint8_t keeping the
+// order and the differences, and uint8_t to int8_t by subtracting 128.
+UTIL_SIMD_AVX2 inline __m256i Flip(__m256i v) {
+    return _mm256_xor_si256(v, _mm256_set1_epi8((char)0x80));
+}
+
+UTIL_SIMD_AVX512 inline __m512i Flip(__m512i v) {
+    return _mm512_xor_si512(v, _mm512_set1_epi8((char)0x80));
+}
+
+template <typename T>
+UTIL_SIMD_AVX2 int64_t L1Int8Avx2(const T* v1, const T* v2, size_t dim) {
+    bool is_signed = std::is_signed<T>::value;
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(v1 + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(v2 + i));
+        if (is_signed) {
+            a = Flip(a);
+            b = Flip(b);
+        }
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(a, b));
+    }
+    return Sum64x4(sum) + Scalar<T, T, int64_t>::L1(v1 + i, v2 + i, dim - i);
+}
+
+template <typename T>
+UTIL_SIMD_AVX2 int64_t L2SqrInt8Avx2(const T* v1, const T* v2, size_t dim) {
+    int64_t result = 0;
+    size_t i = 0;
+    while (i + 16 <= dim) {
+        size_t end = std::min(dim, i + INT_BLOCK);
+        __m256i sum = _mm256_setzero_si256();
+        for (; i + 16 <= end; i += 16) {
+            __m256i delta = _mm256_sub_epi16(Widen16(v1 + i),
+                    Widen16(v2 + i));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(delta, delta));
+        }
+        result += Sum32x8(sum);
+    }
+    return result + Scalar<T, T, int64_t>::L2Sqr(v1 + i, v2 + i, dim - i);
+}
+
+template <typename T>
+UTIL_SIMD_AVX2 int64_t IPInt8Avx2(const T* v1, const T* v2, size_t dim) {
+    int64_t result = 0;
+    size_t i = 0;
+    while (i + 16 <= dim) {
+        size_t end = std::min(dim, i + INT_BLOCK);
+        __m256i sum = _mm256_setzero_si256();
+        for (; i + 16 <= end; i += 16) {
+            sum = _mm256_add_epi32(sum,
+                    _mm256_madd_epi16(Widen16(v1 + i), Widen16(v2 + i)));
+        }
+        result += Sum32x8(sum);
+    }
+    return result + Scalar<T, T, int64_t>::IP(v1 + i, v2 + i, dim - i);
+}
+
+template <typename T>
+UTIL_SIMD_AVX512 int64_t L1Int8Avx512(const T* v1, const T* v2,
+        size_t dim) {
+    bool is_signed = std::is_signed<T>::value;
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= dim; i += 64) {
+        __m512i a = _mm512_loadu_si512(v1 + i);
+        __m512i b = _mm512_loadu_si512(v2 + i);
+        if (is_signed) {
+            a = Flip(a);
+            b = Flip(b);
+        }
+        sum = _mm512_add_epi64(sum, _mm512_sad_epu8(a, b));
+    }
+    return _mm512_reduce_add_epi64(sum) + L1Int8Avx2(v1 + i, v2 + i, dim - i);
+}
+
+template <typename T>
+UTIL_SIMD_AVX512 int64_t L2SqrInt8Avx512(const T* v1, const T* v2,
+        size_t dim) {
+    int64_t result = 0;
+    size_t i = 0;
+    while (i + 32 <= dim) {
+        size_t end = std::min(dim, i + INT_BLOCK);
+        __m512i sum = _mm512_setzero_si512();
+        for (; i + 32 <= end; i += 32) {
+            __m512i delta = _mm512_sub_epi16(Widen32(v1 + i),
+                    Widen32(v2 + i));
+            sum = _mm512_add_epi32(sum, _mm512_madd_epi16(delta, delta));
+        }
+        result += Sum32x16(sum);
+    }
+    return result + L2SqrInt8Avx2(v1 + i, v2 + i, dim - i);
+}
+
+template <typename T>
+UTIL_SIMD_AVX512 int64_t IPInt8Avx512(const T* v1, const T* v2,
+        size_t dim) {
+    int64_t result = 0;
+    size_t i = 0;
+    while (i + 32 <= dim) {
+        size_t end = std::min(dim, i + INT_BLOCK);
+        __m512i sum = _mm512_setzero_si512();
+        for (; i + 32 <= end; i += 32) {
+            sum = _mm512_add_epi32(sum,
+                    _mm512_madd_epi16(Widen32(v1 + i), Widen32(v2 + i)));
+        }
+        result += Sum32x16(sum);
+    }
+    return result + IPInt8Avx2(v1 + i, v2 + i, dim - i);
+}
+
+template <typename T>
+UTIL_SIMD_VNNI int64_t L2SqrInt8Vnni(const T* v1, const T* v2, size_t dim) {
+    int64_t result = 0;
+    size_t i = 0;
+    while (i + 32 <= dim) {
+        size_t end = std::min(dim, i + INT_BLOCK);
+        __m512i sum = _mm512_setzero_si512();
+        for (; i + 32 <= end; i += 32) {
+            __m512i delta = _mm512_sub_epi16(Widen32(v1 + i),
+                    Widen32(v2 + i));
+            sum = _mm512_dpwssd_epi32(sum, delta, delta);
+        }
+        result += Sum32x16(sum);
+    }
+    return result + L2SqrInt8Avx2(v1 + i, v2 + i, dim - i);
+}
+
+// VPDPBUSD multiplies unsigned bytes by signed bytes, so one side is
+// flipped into the other signedness, and the bias is corrected with the
+// byte sums computed by VPSADBW:
+//   uint8_t: a * b = a * (b - 128) + 128 * a
+//   int8_t:  a * b = (a + 128) * b - 128 * ((b + 128) - 128)
+template <typename T>
+UTIL_SIMD_VNNI int64_t IPInt8Vnni(const T* v1, const T* v2, size_t dim) {
+    bool is_signed = std::is_signed<T>::value;
+    const __m512i zero = _mm512_setzero_si512();
+    int64_t result = 0;
+    int64_t bias = 0;
+    size_t i = 0;
+    while (i + 64 <= dim) {
+        size_t end = std::min(dim, i + INT_BLOCK);
+        __m512i sum = _mm512_setzero_si512();
+        __m512i bytes = _mm512_setzero_si512();
+        size_t count = 0;
+        for (; i + 64 <= end; i += 64) {
+            __m512i a = _mm512_loadu_si512(v1 + i);
+            __m512i b = _mm512_loadu_si512(v2 + i);
+            __m512i fb = Flip(b);
+            if (is_signed) {
+                sum = _mm512_dpbusd_epi32(sum, Flip(a), b);
+                bytes = _mm512_add_epi64(bytes, _mm512_sad_epu8(fb, zero));
+            }
+            else {
+                sum = _mm512_dpbusd_epi32(sum, a, fb);
+                bytes = _mm512_add_epi64(bytes, _mm512_sad_epu8(a, zero));
+            }
+            count += 64;
+        }
+        result += Sum32x16(sum);
+        int64_t total = _mm512_reduce_add_epi64(bytes);
+        bias += is_signed ? -128 * (total - 128 * (int64_t)count) :
+                128 * total;
+    }
+    return result + bias + IPInt8Avx512(v1 + i, v2 + i, dim - i);
+}
+
+/* 32-bit integer kernels, exact in 64-bit arithmetic. VPMULDQ multiplies
+ * the even lanes, so the odd ones are shifted down for a second pass. */
+
+UTIL_SIMD_AVX2 inline __m256i MulAdd32(__m256i sum, __m256i a, __m256i b) {
+    sum = _mm256_add_epi64(sum, _mm256_mul_epi32(a, b));
+    return _mm256_add_epi64(sum, _mm256_mul_epi32(_mm256_srli_epi64(a, 32),
+            _mm256_srli_epi64(b, 32)));
+}
+
+UTIL_SIMD_AVX2 inline int64_t L1Int32Avx2(const int32_t* v1,
+        const int32_t* v2, size_t dim) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        __m256i a = _mm256_cvtepi32_epi64(
+                _mm_loadu_si128((const __m128i*)(v1 + i)));
+        __m256i b = _mm256_cvtepi32_epi64(
+                _mm_loadu_si128((const __m128i*)(v2 + i)));
+        __m256i delta = _mm256_sub_epi64(a, b);
+        __m256i sign = _mm256_cmpgt_epi64(zero, delta);
+        delta = _mm256_sub_epi64(_mm256_xor_si256(delta, sign), sign);
+        sum = _mm256_add_epi64(sum, delta);
+    }
+    return Sum64x4(sum) +
+            Scalar<int32_t, int32_t, int64_t>::L1(v1 + i, v2 + i, dim - i);
+}
+
+// (a - b)^2 = a^2 + b^2 - 2ab holds in the wrapping 64-bit arithmetic.
+UTIL_SIMD_AVX2 inline int64_t L2SqrInt32Avx2(const int32_t* v1,
+        const int32_t* v2, size_t dim) {
+    __m256i squares = _mm256_setzero_si256();
+    __m256i products = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(v1 + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(v2 + i));
+        squares = MulAdd32(MulAdd32(squares, a, a), b, b);
+        products = MulAdd32(products, a, b);
+    }
+    __m256i sum = _mm256_sub_epi64(squares, _mm256_add_epi64(products,
+            products));
+    return Sum64x4(sum) +
+            Scalar<int32_t, int32_t, int64_t>::L2Sqr(v1 + i, v2 + i, dim - i);
+}
+
+UTIL_SIMD_AVX2 inline int64_t IPInt32Avx2(const int32_t* v1,
+        const int32_t* v2, size_t dim) {
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(v1 + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(v2 + i));
+        sum = MulAdd32(sum, a, b);
+    }
+    return Sum64x4(sum) +
+            Scalar<int32_t, int32_t, int64_t>::IP(v1 + i, v2 + i, dim - i);
+}
+
+/* Inner products between every row of x and every row of y. Each tile of
+ * M x N rows keeps its dot products in registers, so every load is used
+ * for several FMAs. The tail of the rows is read with masked loads. */
+
+UTIL_SIMD_AVX2 inline __m256i Mask8(size_t count) {
+    static const int32_t table[16] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+    return _mm256_loadu_si256((const __m256i*)(table + 8 - count));
+}
+
+template <size_t M, size_t N>
+UTIL_SIMD_AVX2 inline void TileAvx2(const float* x, const float* y,
+        size_t dim, float* out, size_t ny) {
+    __m256 sums[M][N];
+    for (size_t i = 0; i < M; i++) {
+        for (size_t j = 0; j < N; j++) {
+            sums[i][j] = _mm256_setzero_ps();
+        }
+    }
+    size_t d = 0;
+    for (; d + 8 <= dim; d += 8) {
+        __m256 vy[N];
+        for (size_t j = 0; j < N; j++) {
+            vy[j] = _mm256_loadu_ps(y + j * dim + d);
+        }
+        for (size_t i = 0; i < M; i++) {
+            __m256 vx = _mm256_loadu_ps(x + i * dim + d);
+            for (size_t j = 0; j < N; j++) {
+                sums[i][j] = _mm256_fmadd_ps(vx, vy[j], sums[i][j]);
+            }
+        }
+    }
+    if (d < dim) {
+        __m256i mask = Mask8(dim - d);
+        __m256 vy[N];
+        for (size_t j = 0; j < N; j++) {
+            vy[j] = _mm256_maskload_ps(y + j * dim + d, mask);
+        }
+        for (size_t i = 0; i < M; i++) {
+            __m256 vx = _mm256_maskload_ps(x + i * dim + d, mask);
+            for (size_t j = 0; j < N; j++) {
+                sums[i][j] = _mm256_fmadd_ps(vx, vy[j], sums[i][j]);
+            }
+        }
+    }
+    for (size_t i = 0; i < M; i++) {
+        for (size_t j = 0; j < N; j++) {
+            out[i * ny + j] = Sum8(sums[i][j]);
+        }
+    }
+}
+
+template <size_t M, size_t N>
+UTIL_SIMD_AVX512 inline void TileAvx512(const float* x, const float* y,
+        size_t dim, float* out, size_t ny) {
+    __m512 sums[M][N];
+    for (size_t i = 0; i < M; i++) {
+        for (size_t j = 0; j < N; j++) {
+            sums[i][j] = _mm512_setzero_ps();
+        }
+    }
+    for (size_t d = 0; d < dim; d += 16) {
+        __mmask16 mask = dim - d >= 16 ? 0xffff :
+                (__mmask16)((1u << (dim - d)) - 1);
+        __m512 vy[N];
+        for (size_t j = 0; j < N; j++) {
+            vy[j] = _mm512_maskz_loadu_ps(mask, y + j * dim + d);
+        }
+        for (size_t i = 0; i < M; i++) {
+            __m512 vx = _mm512_maskz_loadu_ps(mask, x + i * dim + d);
+            for (size_t j = 0; j < N; j++) {
+                sums[i][j] = _mm512_fmadd_ps(vx, vy[j], sums[i][j]);
+            }
+        }
+    }
+    for (size_t i = 0; i < M; i++) {
+        for (size_t j = 0; j < N; j++) {
+            out[i * ny + j] = _mm512_reduce_add_ps(sums[i][j]);
+        }
+    }
+}
+
+UTIL_SIMD_AVX2 inline void InnerProductsAvx2(const float* x, size_t nx,
+        const float* y, size_t ny, size_t dim, float* out) {
+    size_t i = 0;
+    for (; i + 4 <= nx; i += 4) {
+        size_t j = 0;
+        for (; j + 2 <= ny; j += 2) {
+            TileAvx2<4, 2>(x + i * dim, y + j * dim, dim, out + i * ny + j,
+                    ny);
+        }
+        for (; j < ny; j++) {
+            TileAvx2<4, 1>(x + i * dim, y + j * dim, dim, out + i * ny + j,
+                    ny);
+        }
+    }
+    for (; i < nx; i++) {
+        size_t j = 0;
+        for (; j + 2 <= ny; j += 2) {
+            TileAvx2<1, 2>(x + i * dim, y + j * dim, dim, out + i * ny + j,
+                    ny);
+        }
+        for (; j < ny; j++) {
+            TileAvx2<1, 1>(x + i * dim, y + j * dim, dim, out + i * ny + j,
+                    ny);
+        }
+    }
+}
+
+UTIL_SIMD_AVX512 inline void InnerProductsAvx512(const float* x, size_t nx,
+        const float* y, size_t ny, size_t dim, float* out) {
+    size_t i = 0;
+    for (; i + 4 <= nx; i += 4) {
+        size_t j = 0;
+        for (; j + 4 <= ny; j += 4) {
+            TileAvx512<4, 4>(x + i * dim, y + j * dim, dim,
+                    out + i * ny + j, ny);
+        }
+        for (; j < ny; j++) {
+            TileAvx512<4, 1>(x + i * dim, y + j * dim, dim,
+                    out + i * ny + j, ny);
+        }
+    }
+    for (; i < nx; i++) {
+        size_t j = 0;
+        for (; j + 4 <= ny; j += 4) {
+            TileAvx512<1, 4>(x + i * dim, y + j * dim, dim,
+                    out + i * ny + j, ny);
+        }
+        for (; j < ny; j++) {
+            TileAvx512<1, 1>(x + i * dim, y + j * dim, dim,
+                    out + i * ny + j, ny);
+        }
+    }
+}
+
+template <typename T>
+struct IsFloatElement {
+    static const bool value = std::is_same<T, float>::value ||
+            std::is_same<T, uint8_t>::value ||
+            std::is_same<T, int8_t>::value ||
+            std::is_same<T, int32_t>::value;
+};
+
+// Float results with at least one float side.
+template <typename TV1, typename TV2>
+struct Distance<TV1, TV2, float, typename std::enable_if<
+        IsFloatElement<TV1>::value && IsFloatElement<TV2>::value &&
+        (std::is_same<TV1, float>::value ||
+        std::is_same<TV2, float>::value)>::type> {
+
+    typedef float (*func_t)(const TV1*, const TV2*, size_t);
+
+    static float L1(const TV1* v1, const TV2* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<TV1, TV2, float>::L1, L1FloatAvx2<TV1, TV2>,
+                L1FloatAvx512<TV1, TV2>, nullptr);
+        return func(v1, v2, dim);
+    }
+
+    static float L2Sqr(const TV1* v1, const TV2* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<TV1, TV2, float>::L2Sqr, L2SqrFloatAvx2<TV1, TV2>,
+                L2SqrFloatAvx512<TV1, TV2>, nullptr);
+        return func(v1, v2, dim);
+    }
+
+    static float IP(const TV1* v1, const TV2* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<TV1, TV2, float>::IP, IPFloatAvx2<TV1, TV2>,
+                IPFloatAvx512<TV1, TV2>, nullptr);
+        return func(v1, v2, dim);
+    }
+
+};
+
+template <typename T>
+struct Distance<T, T, int64_t, typename std::enable_if<
+        std::is_same<T, uint8_t>::value ||
+        std::is_same<T, int8_t>::value>::type> {
+
+    typedef int64_t (*func_t)(const T*, const T*, size_t);
+
+    static int64_t L1(const T* v1, const T* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<T, T, int64_t>::L1, L1Int8Avx2<T>,
+                L1Int8Avx512<T>, nullptr);
+        return func(v1, v2, dim);
+    }
+
+    static int64_t L2Sqr(const T* v1, const T* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<T, T, int64_t>::L2Sqr, L2SqrInt8Avx2<T>,
+                L2SqrInt8Avx512<T>, L2SqrInt8Vnni<T>);
+        return func(v1, v2, dim);
+    }
+
+    static int64_t IP(const T* v1, const T* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<T, T, int64_t>::IP, IPInt8Avx2<T>,
+                IPInt8Avx512<T>, IPInt8Vnni<T>);
+        return func(v1, v2, dim);
+    }
+
+};
+
+template <>
+struct Distance<int32_t, int32_t, int64_t> {
+
+    typedef int64_t (*func_t)(const int32_t*, const int32_t*, size_t);
+
+    static int64_t L1(const int32_t* v1, const int32_t* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<int32_t, int32_t, int64_t>::L1, L1Int32Avx2,
+                nullptr, nullptr);
+        return func(v1, v2, dim);
+    }
+
+    static int64_t L2Sqr(const int32_t* v1, const int32_t* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<int32_t, int32_t, int64_t>::L2Sqr, L2SqrInt32Avx2,
+                nullptr, nullptr);
+        return func(v1, v2, dim);
+    }
+
+    static int64_t IP(const int32_t* v1, const int32_t* v2, size_t dim) {
+        static const func_t func = Select<func_t>(
+                Scalar<int32_t, int32_t, int64_t>::IP, IPInt32Avx2,
+                nullptr, nullptr);
+        return func(v1, v2, dim);
+    }
+
+};
+
+#pragma GCC diagnostic pop
+
+#endif
+
+inline void InnerProductsScalar(const float* x, size_t nx, const float* y,
+        size_t ny, size_t dim, float* out) {
+    for (size_t i = 0; i < nx; i++) {
+        for (size_t j = 0; j < ny; j++) {
+            out[i * ny + j] = Scalar<float, float, float>::IP(x + i * dim,
+                    y + j * dim, dim);
+        }
+    }
+}
+
+// out[i * ny + j] = x[i] * y[j] for the rows x[0, nx) and y[0, ny) of two
+// row-major matrices with <dim> columns.
+inline void InnerProducts(const float* x, size_t nx, const float* y,
+        size_t ny, size_t dim, float* out) {
+    typedef void (*func_t)(const float*, size_t, const float*, size_t,
+            size_t, float*);
+#if defined(__x86_64__)
+    static const func_t func = Select<func_t>(InnerProductsScalar,
+            InnerProductsAvx2, InnerProductsAvx512, nullptr);
+#else
+    static const func_t func = InnerProductsScalar;
+#endif
+    func(x, nx, y, ny, dim, out);
+}
+
+}
+
+}
+
+#endif
@@ -2,11 +2,14 @@
 #define UTIL_STATISTICS_H
 
 #include <cmath>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <cassert>
 #include <algorithm>
 #include <stdexcept>
 
+#include <stdint.h>
 #include <string.h>
 
 namespace util {
@@ -92,6 +95,161 @@ private:
     }
 };
 
+class SharedHistogram;
+
+// An HDR-style histogram of non-negative integers, where smaller is better,
+// with the same profile as Percentile but constant memory and O(1) add().
+// A value v is counted in a bucket of width below v / 2^(SUB_BITS - 1), so
+// the percentiles are within that relative error, while best(), worst()
+// and average() are exact. Each thread may record into its own histogram,
+// and the histograms are merged at the end.
+class Histogram {
+
+    friend class SharedHistogram;
+
+private:
+    static const int SUB_BITS = 8;
+    static const size_t SUB_COUNT = (size_t)1 << SUB_BITS;
+    static const size_t HALF_COUNT = SUB_COUNT / 2;
+    static const size_t BUCKET_COUNT = SUB_COUNT +
+            (64 - SUB_BITS) * HALF_COUNT;
+
+    std::vector<uint64_t> buckets;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+
+public:
+    Histogram() : buckets(BUCKET_COUNT, 0), total(0), min(UINT64_MAX),
+            max(0), sum(0) {}
+
+    void add(uint64_t x, uint64_t count = 1) {
+        buckets[index(x)] += count;
+        total += count;
+        min = std::min(min, x);
+        max = std::max(max, x);
+        sum += (double)x * count;
+    }
+
+    void merge(const Histogram& another) {
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            buckets[i] += another.buckets[i];
+        }
+        total += another.total;
+        min = std::min(min, another.min);
+        max = std::max(max, another.max);
+        sum += another.sum;
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t best() const {
+        if (total == 0) {
+            throw std::runtime_error("no data to profile!");
+        }
+        return min;
+    }
+
+    uint64_t worst() const {
+        if (total == 0) {
+            throw std::runtime_error("no data to profile!");
+        }
+        return max;
+    }
+
+    double average() const {
+        return sum / total;
+    }
+
+    // The highest value of the bucket holding the percentile, but not
+    // beyond worst().
+    uint64_t operator ()(double percentage) const {
+        if (percentage < 0.0 || percentage > 100.0) {
+            throw std::runtime_error("<percentage> should be within "
+                    "[0.0, 100.0]!");
+        }
+        if (total == 0) {
+            throw std::runtime_error("no data to profile!");
+        }
+        uint64_t n = std::min(total, std::max<uint64_t>(1,
+                (uint64_t)std::ceil(total * percentage / 100.0)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            seen += buckets[i];
+            if (seen >= n) {
+                return std::max(min, std::min(max, highest(i)));
+            }
+        }
+        return max;
+    }
+
+private:
+    // Values below SUB_COUNT have buckets of their own. Above, each power
+    // of two is split into HALF_COUNT buckets.
+    static size_t index(uint64_t x) {
+        if (x < SUB_COUNT) {
+            return x;
+        }
+        int shift = 64 - __builtin_clzll(x) - SUB_BITS;
+        return SUB_COUNT + (shift - 1) * HALF_COUNT +
+                ((x >> shift) - HALF_COUNT);
+    }
+
+    static uint64_t highest(size_t i) {
+        if (i < SUB_COUNT) {
+            return i;
+        }
+        size_t k = i - SUB_COUNT;
+        int shift = k / HALF_COUNT + 1;
+        uint64_t sub = k % HALF_COUNT + HALF_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+};
+
+// The buckets of a Histogram, recorded by one thread and taken by another
+// without locks, as only the recording thread writes the counters.
+class SharedHistogram {
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::vector<uint64_t> taken;
+
+public:
+    SharedHistogram() :
+            counts(new std::atomic<uint64_t>[Histogram::BUCKET_COUNT]),
+            taken(Histogram::BUCKET_COUNT, 0) {
+        for (size_t i = 0; i < Histogram::BUCKET_COUNT; i++) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // By the recording thread only.
+    void add(uint64_t x, uint64_t count = 1) {
+        std::atomic<uint64_t>& n = counts[Histogram::index(x)];
+        n.store(n.load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+    }
+
+    // Add what is recorded since the last take() to <window>, as the highest
+    // values of the buckets, so the best(), worst() and average() of
+    // <window> are no more precise than its percentiles. By the taking
+    // thread only.
+    void take(Histogram& window) {
+        for (size_t i = 0; i < Histogram::BUCKET_COUNT; i++) {
+            uint64_t n = counts[i].load(std::memory_order_relaxed);
+            if (n != taken[i]) {
+                window.add(Histogram::highest(i), n - taken[i]);
+                taken[i] = n;
+            }
+        }
+    }
+
+};
+
 }
 
 }
@@ -1,25 +1,68 @@
 #ifndef UTIL_VECS_H
 #define UTIL_VECS_H
 
+#include <mutex>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cassert>
 #include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <condition_variable>
 
 #include <zlib.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vector.h"
+
+#ifndef UTIL_VECS_GZ_SPAN
+#define UTIL_VECS_GZ_SPAN       (32UL << 20)
+#endif
+
+// Count of threads to (de)compress .bgz files, 0 for all the processors.
+#ifndef UTIL_VECS_BGZF_THREADS
+#define UTIL_VECS_BGZF_THREADS  0
+#endif
+
+// Whether .gz files are written in BGZF blocks, in parallel as .bgz files,
+// instead of a single gzip stream. Both are valid gzip.
+#ifndef UTIL_VECS_GZ_AS_BGZF
+#define UTIL_VECS_GZ_AS_BGZF    1
+#endif
 
 namespace util {
 
 namespace vecs {
 
 class File {
+private:
+    bool dense;
+
 public:
+    File() : dense(false) {}
+
     virtual ~File() {}
 
+    // Whether the vectors are stored as a dense matrix after a header of
+    // uint32_t count and dimension (.fbin, .u8bin, .i8bin and .ibin),
+    // instead of each one after its own dimension (.[c/b/i/f]vecs).
+    bool isDense() const {
+        return dense;
+    }
+
+    void setDense(bool _dense) {
+        dense = _dense;
+    }
+
     virtual void open(const char* fpath, bool rw) = 0;
 
     virtual void close() = 0;
@@ -31,6 +74,17 @@ public:
     virtual ssize_t seek(size_t position, int whence) = 0;
 
     virtual bool eof() = 0;
+
+    // Return the total length of the content in bytes, or -1 if unknown.
+    virtual ssize_t size() {
+        return -1;
+    }
+
+    // Return a pointer to the next <len> bytes and move forward, or nullptr
+    // if the file can not expose its content without copying.
+    virtual const void* view(size_t len) {
+        return nullptr;
+    }
 };
 
 class PlainFile : public File {
@@ -78,6 +132,14 @@ public:
         return feof(file);
     }
 
+    ssize_t size() override {
+        struct stat st;
+        if (fstat(fileno(file), &st) != 0) {
+            return -1;
+        }
+        return st.st_size;
+    }
+
 };
 
 class GzFile : public File {
@@ -127,64 +189,1371 @@ public:
 
 };
 
-template <typename T>
-class Formater {
+class MmapFile : public File {
 
 private:
-    File* file;
+    uint8_t* data;
+    size_t length;
+    size_t cursor;
+    bool opened;
 
 public:
-    Formater(File* _file) : file(_file) {}
+    MmapFile() : data(nullptr), length(0), cursor(0), opened(false) {}
 
-    std::vector<T> read() {
-        uint32_t dim;
-        std::vector<T> vector;
-        ssize_t ret = file->read(&dim, sizeof(dim));
-        if (ret == 0) {
-            assert(file->eof());
-            return vector;
+    ~MmapFile() {
+        assert(!opened);
+    }
+
+    void open(const char* fpath, bool rw) override {
+        assert(!opened);
+        if (!rw) {
+            throw std::runtime_error(std::string("cannot map file '")
+                    .append(fpath).append("' for writing!"));
+        }
+        int fd = ::open(fpath, O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpath).append("'!"));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error(std::string("cannot stat file '")
+                    .append(fpath).append("'!"));
+        }
+        length = st.st_size;
+        if (length) {
+            void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error(std::string("cannot map file '")
+                        .append(fpath).append("'!"));
+            }
+            data = (uint8_t*)addr;
+            madvise(data, length, MADV_SEQUENTIAL);
+            madvise(data, length, MADV_WILLNEED);
+        }
+        ::close(fd);
+        cursor = 0;
+        opened = true;
+    }
+
+    void close() override {
+        if (data && munmap(data, length)) {
+            throw std::runtime_error("cannot close file!");
+        }
+        data = nullptr;
+        length = 0;
+        opened = false;
+    }
+
+    ssize_t read(void* buf, size_t len) override {
+        len = std::min(len, length - cursor);
+        memcpy(buf, data + cursor, len);
+        cursor += len;
+        return len;
+    }
+
+    ssize_t write(const void* buf, size_t len) override {
+        return -1;
+    }
+
+    ssize_t seek(size_t position, int whence) override {
+        size_t base;
+        if (whence == SEEK_SET) {
+            base = 0;
+        }
+        else if (whence == SEEK_CUR) {
+            base = cursor;
+        }
+        else if (whence == SEEK_END) {
+            base = length;
+        }
+        else {
+            return -1;
+        }
+        if (position > length - base) {
+            return -1;
+        }
+        cursor = base + position;
+        return cursor;
+    }
+
+    bool eof() override {
+        return cursor >= length;
+    }
+
+    ssize_t size() override {
+        return length;
+    }
+
+    const void* view(size_t len) override {
+        if (len > length - cursor) {
+            return nullptr;
+        }
+        const void* ptr = data + cursor;
+        cursor += len;
+        return ptr;
+    }
+
+};
+
+// Read-only gzip file supporting random access. While the content is
+// inflated, an access point (the compressed offset plus the 32KB window
+// needed to resume inflating there) is recorded every
+// UTIL_VECS_GZ_SPAN bytes of output, like zlib's examples/zran.c. Once the
+// whole file has been inflated, the access points are saved to
+// '<fpath>.zran' so that later runs can seek right away.
+class SeekableGzFile : public File {
+
+private:
+    static const size_t IN_SIZE = 256 << 10;
+    static const size_t OUT_SIZE = 1 << 20;
+    static const size_t WINDOW_SIZE = 32768;
+    static const uint32_t INDEX_MAGIC = 0x4e41525a;     // "ZRAN"
+
+    struct Point {
+        uint64_t out;
+        uint64_t in;
+        int bits;
+        std::vector<uint8_t> window;
+    };
+
+    std::string index_fpath;
+    struct stat gz_stat;
+    FILE* file;
+    z_stream strm;
+    bool raw;
+    bool finished;
+    std::vector<uint8_t> in_buf;
+    uint64_t in_base;
+    std::vector<uint8_t> out_buf;
+    size_t out_begin;
+    size_t out_end;
+    uint64_t out_base;
+    std::vector<Point> points;
+    bool complete;
+    bool dirty;
+    uint64_t total;
+
+public:
+    SeekableGzFile() : file(nullptr) {}
+
+    ~SeekableGzFile() {
+        assert(!file);
+    }
+
+    void open(const char* fpath, bool rw) override {
+        assert(!file);
+        if (!rw) {
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpath).append("' for writing!"));
+        }
+        file = fopen(fpath, "rb");
+        if (!file) {
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpath).append("'!"));
+        }
+        memset(&strm, 0, sizeof(strm));
+        if (fstat(fileno(file), &gz_stat) != 0 ||
+                inflateInit2(&strm, 15 + 16) != Z_OK) {
+            fclose(file);
+            file = nullptr;
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpath).append("'!"));
+        }
+        in_buf.resize(IN_SIZE);
+        out_buf.resize(OUT_SIZE);
+        index_fpath.assign(fpath).append(".zran");
+        points.clear();
+        complete = false;
+        dirty = false;
+        total = 0;
+        loadIndex();
+        restart();
+    }
+
+    void close() override {
+        inflateEnd(&strm);
+        int ret = fclose(file);
+        file = nullptr;
+        if (dirty) {
+            saveIndex();
+        }
+        if (ret) {
+            throw std::runtime_error("cannot close file!");
         }
-        if (ret != sizeof(dim)) {
+    }
+
+    ssize_t read(void* buf, size_t len) override {
+        uint8_t* dst = (uint8_t*)buf;
+        size_t done = 0;
+        while (done < len) {
+            if (out_begin == out_end && !fill(1)) {
+                break;
+            }
+            size_t n = std::min(len - done, out_end - out_begin);
+            memcpy(dst + done, out_buf.data() + out_begin, n);
+            out_begin += n;
+            done += n;
+        }
+        return done;
+    }
+
+    ssize_t write(const void* buf, size_t len) override {
+        return -1;
+    }
+
+    ssize_t seek(size_t position, int whence) override {
+        uint64_t target;
+        if (whence == SEEK_SET) {
+            target = position;
+        }
+        else if (whence == SEEK_CUR) {
+            target = out_base + out_begin + position;
+        }
+        else if (whence == SEEK_END) {
+            ssize_t length = size();
+            if (length < 0 || position > (size_t)length) {
+                return -1;
+            }
+            target = length - position;
+        }
+        else {
+            return -1;
+        }
+        if (complete && target > total) {
+            return -1;
+        }
+        if (target < out_base) {
+            restart();
+        }
+        const Point* point = nearest(target);
+        if (point && point->out > out_base + out_end) {
+            restore(*point);
+        }
+        while (target > out_base + out_end) {
+            out_begin = out_end;
+            if (!fill(1)) {
+                return -1;
+            }
+        }
+        out_begin = target - out_base;
+        return target;
+    }
+
+    bool eof() override {
+        return out_begin == out_end && finished;
+    }
+
+    ssize_t size() override {
+        if (!complete) {
+            uint64_t position = out_base + out_begin;
+            while (true) {
+                out_begin = out_end;
+                if (!fill(1)) {
+                    break;
+                }
+            }
+            assert(complete);
+            if (seek(position, SEEK_SET) < 0) {
+                return -1;
+            }
+        }
+        return total;
+    }
+
+    const void* view(size_t len) override {
+        if (len > OUT_SIZE) {
+            return nullptr;
+        }
+        if (out_end - out_begin < len && !fill(len)) {
+            return nullptr;
+        }
+        const void* ptr = out_buf.data() + out_begin;
+        out_begin += len;
+        return ptr;
+    }
+
+private:
+    // Inflate until at least <len> bytes are buffered after out_begin.
+    // Return false if the content ends before that.
+    bool fill(size_t len) {
+        assert(len <= OUT_SIZE);
+        if (out_begin) {
+            memmove(out_buf.data(), out_buf.data() + out_begin,
+                    out_end - out_begin);
+            out_base += out_begin;
+            out_end -= out_begin;
+            out_begin = 0;
+        }
+        while (out_end < len && !finished) {
+            if (strm.avail_in == 0) {
+                in_base += strm.next_in - in_buf.data();
+                strm.avail_in = fread(in_buf.data(), 1, IN_SIZE, file);
+                strm.next_in = in_buf.data();
+                if (strm.avail_in == 0) {
+                    if (ferror(file)) {
+                        throw std::runtime_error("cannot read file!");
+                    }
+                    throw std::runtime_error("broken file!");
+                }
+            }
+            strm.next_out = out_buf.data() + out_end;
+            strm.avail_out = OUT_SIZE - out_end;
+            int ret = inflate(&strm, Z_BLOCK);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                throw std::runtime_error("broken file!");
+            }
+            out_end = strm.next_out - out_buf.data();
+            if (ret == Z_STREAM_END) {
+                nextMember();
+            }
+            else if ((strm.data_type & 128) && !(strm.data_type & 64)) {
+                addPoint();
+            }
+        }
+        return out_end >= len;
+    }
+
+    // Skip the trailer of the current gzip member, and prepare for the next
+    // member if any, so that concatenated (e.g. block-compressed) gzip files
+    // are inflated entirely.
+    void nextMember() {
+        if (raw) {
+            uint8_t trailer[8];
+            for (size_t i = 0; i < sizeof(trailer); i++) {
+                if (!nextByte(trailer[i])) {
+                    throw std::runtime_error("broken file!");
+                }
+            }
+        }
+        uint8_t magic;
+        if (!nextByte(magic)) {
+            finish();
+            return;
+        }
+        if (magic != 0x1f) {
+            finish();
+            return;
+        }
+        strm.next_in--;
+        strm.avail_in++;
+        if (inflateReset2(&strm, 15 + 16) != Z_OK) {
             throw std::runtime_error("broken file!");
         }
-        vector.resize(dim);
-        ret = file->read(vector.data(), sizeof(T) * dim);
-        if (ret != (ssize_t)sizeof(T) * dim) {
+        raw = false;
+    }
+
+    bool nextByte(uint8_t& byte) {
+        if (strm.avail_in == 0) {
+            in_base += strm.next_in - in_buf.data();
+            strm.avail_in = fread(in_buf.data(), 1, IN_SIZE, file);
+            strm.next_in = in_buf.data();
+            if (strm.avail_in == 0) {
+                return false;
+            }
+        }
+        byte = *strm.next_in++;
+        strm.avail_in--;
+        return true;
+    }
+
+    void finish() {
+        finished = true;
+        if (!complete) {
+            complete = true;
+            dirty = true;
+            total = out_base + out_end;
+        }
+    }
+
+    void addPoint() {
+        uint64_t out = out_base + out_end;
+        uint64_t last = points.empty() ? 0 : points.back().out;
+        if (complete || out < last + UTIL_VECS_GZ_SPAN) {
+            return;
+        }
+        Point point;
+        point.out = out;
+        point.in = in_base + (strm.next_in - in_buf.data());
+        point.bits = strm.data_type & 7;
+        point.window.resize(WINDOW_SIZE);
+        uInt wlen = WINDOW_SIZE;
+        if (inflateGetDictionary(&strm, point.window.data(), &wlen) != Z_OK) {
+            return;
+        }
+        point.window.resize(wlen);
+        points.emplace_back(std::move(point));
+    }
+
+    const Point* nearest(uint64_t target) const {
+        const Point* point = nullptr;
+        size_t lo = 0, hi = points.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (points[mid].out <= target) {
+                point = &points[mid];
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        return point;
+    }
+
+    void restart() {
+        if (fseeko(file, 0, SEEK_SET) != 0 ||
+                inflateReset2(&strm, 15 + 16) != Z_OK) {
             throw std::runtime_error("broken file!");
         }
-        return vector;
+        raw = false;
+        finished = false;
+        strm.next_in = in_buf.data();
+        strm.avail_in = 0;
+        in_base = 0;
+        out_base = 0;
+        out_begin = 0;
+        out_end = 0;
     }
 
-    bool skip() {
-        uint32_t dim;
-        ssize_t ret = file->read(&dim, sizeof(dim));
-        if (ret == 0) {
-            assert(file->eof());
-            return false;
+    void restore(const Point& point) {
+        uint64_t in = point.in - (point.bits ? 1 : 0);
+        if (fseeko(file, in, SEEK_SET) != 0 ||
+                inflateReset2(&strm, -15) != Z_OK) {
+            throw std::runtime_error("broken file!");
+        }
+        raw = true;
+        finished = false;
+        strm.next_in = in_buf.data();
+        strm.avail_in = 0;
+        in_base = in;
+        if (point.bits) {
+            uint8_t byte;
+            if (!nextByte(byte) ||
+                    inflatePrime(&strm, point.bits,
+                    byte >> (8 - point.bits)) != Z_OK) {
+                throw std::runtime_error("broken file!");
+            }
         }
-        if (ret != sizeof(dim)) {
+        if (inflateSetDictionary(&strm, point.window.data(),
+                point.window.size()) != Z_OK) {
             throw std::runtime_error("broken file!");
         }
+        out_base = point.out;
+        out_begin = 0;
+        out_end = 0;
+    }
+
+    void loadIndex() {
+        FILE* index = fopen(index_fpath.data(), "rb");
+        if (!index) {
+            return;
+        }
+        uint64_t header[5];
+        std::vector<Point> loaded;
+        bool ok = fread(header, sizeof(header), 1, index) == 1 &&
+                header[0] == INDEX_MAGIC &&
+                header[1] == (uint64_t)gz_stat.st_size &&
+                header[2] == (uint64_t)gz_stat.st_mtime;
+        for (uint64_t i = 0; ok && i < header[4]; i++) {
+            Point point;
+            uint64_t meta[4];
+            ok = fread(meta, sizeof(meta), 1, index) == 1 &&
+                    meta[3] <= WINDOW_SIZE;
+            if (ok) {
+                point.out = meta[0];
+                point.in = meta[1];
+                point.bits = meta[2];
+                point.window.resize(meta[3]);
+                ok = fread(point.window.data(), 1, meta[3], index) ==
+                        meta[3];
+                loaded.emplace_back(std::move(point));
+            }
+        }
+        fclose(index);
+        if (ok) {
+            points.swap(loaded);
+            complete = true;
+            total = header[3];
+        }
+    }
+
+    // The index is only a cache, so failing to save it is not an error.
+    void saveIndex() {
+        std::string tmp_fpath = index_fpath + ".tmp";
+        FILE* index = fopen(tmp_fpath.data(), "wb");
+        if (!index) {
+            return;
+        }
+        uint64_t header[5] = {
+            INDEX_MAGIC,
+            (uint64_t)gz_stat.st_size,
+            (uint64_t)gz_stat.st_mtime,
+            total,
+            points.size(),
+        };
+        bool ok = fwrite(header, sizeof(header), 1, index) == 1;
+        for (auto it = points.begin(); ok && it != points.end(); it++) {
+            uint64_t meta[4] = {it->out, it->in, (uint64_t)it->bits,
+                    it->window.size()};
+            ok = fwrite(meta, sizeof(meta), 1, index) == 1 &&
+                    fwrite(it->window.data(), 1, it->window.size(), index) ==
+                    it->window.size();
+        }
+        ok = fclose(index) == 0 && ok;
+        if (!ok || rename(tmp_fpath.data(), index_fpath.data()) != 0) {
+            unlink(tmp_fpath.data());
+        }
+        dirty = false;
+    }
+
+};
+
+// Block-compressed gzip file in the BGZF layout (as produced by bgzip).
+// Content is cut into blocks of at most BLOCK_SIZE bytes, each compressed
+// as an independent gzip member whose extra field records the compressed
+// size. The result is a valid multi-member gzip file, while the blocks can
+// be compressed and decompressed by several threads in parallel.
+class BgzfFile : public File {
+
+private:
+    static const size_t BLOCK_SIZE = 0xff00;
+    static const size_t HEADER_SIZE = 18;
+    static const size_t TRAILER_SIZE = 8;
+
+    struct Block {
+        std::vector<uint8_t> in;
+        std::vector<uint8_t> out;
+        uint64_t offset;
+        bool done;
+    };
+
+    struct Entry {
+        uint64_t coffset;
+        uint64_t uoffset;
+    };
+
+    FILE* file;
+    bool reading;
+    std::vector<Block> blocks;
+    size_t head;
+    size_t tail;
+    size_t next;
+    size_t cursor;
+    uint64_t in_offset;
+    uint64_t out_offset;
+    bool in_end;
+    bool stopping;
+    std::string error;
+    std::mutex mutex;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    std::vector<std::thread> workers;
+    std::vector<Entry> table;
+
+public:
+    BgzfFile() : file(nullptr) {}
+
+    ~BgzfFile() {
+        assert(!file);
+    }
+
+    // Check whether the file at <fpath> starts with a BGZF block.
+    static bool Detect(const char* fpath) {
+        FILE* f = fopen(fpath, "rb");
+        if (!f) {
+            return false;
+        }
+        uint8_t header[HEADER_SIZE];
+        size_t len = fread(header, 1, sizeof(header), f);
+        fclose(f);
+        return len == sizeof(header) && IsHeader(header);
+    }
+
+    void open(const char* fpath, bool rw) override {
+        assert(!file);
+        file = fopen(fpath, rw ? "rb" : "wb");
+        if (!file) {
+            throw std::runtime_error(std::string("cannot open file '")
+                    .append(fpath).append("'!"));
+        }
+        reading = rw;
+        size_t thread_count = UTIL_VECS_BGZF_THREADS;
+        if (thread_count == 0) {
+            thread_count = std::max(1U, std::thread::hardware_concurrency());
+        }
+        blocks.clear();
+        blocks.resize(thread_count * 4);
+        head = tail = next = cursor = 0;
+        in_offset = out_offset = 0;
+        in_end = false;
+        stopping = false;
+        error.clear();
+        table.clear();
+        for (size_t i = 0; i < thread_count; i++) {
+            workers.emplace_back([this] {
+                work();
+            });
+        }
+    }
+
+    void close() override {
+        bool ok = true;
+        if (!reading) {
+            try {
+                if (!blocks[tail % blocks.size()].in.empty()) {
+                    submit();
+                }
+                drain(0);
+                static const uint8_t eof_block[] = {
+                    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+                    0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+                    0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+                    0x00, 0x00, 0x00, 0x00,
+                };
+                ok = fwrite(eof_block, 1, sizeof(eof_block), file) ==
+                        sizeof(eof_block);
+            }
+            catch (const std::exception& e) {
+                ok = false;
+            }
+        }
+        stop();
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok) {
+            throw std::runtime_error("cannot close file!");
+        }
+    }
+
+    ssize_t read(void* buf, size_t len) override {
+        uint8_t* dst = (uint8_t*)buf;
+        size_t done = 0;
+        while (done < len) {
+            Block* block = current();
+            if (!block) {
+                break;
+            }
+            size_t n = std::min(len - done, block->out.size() - cursor);
+            memcpy(dst + done, block->out.data() + cursor, n);
+            cursor += n;
+            done += n;
+        }
+        return done;
+    }
+
+    ssize_t write(const void* buf, size_t len) override {
+        const uint8_t* src = (const uint8_t*)buf;
+        size_t done = 0;
+        while (done < len) {
+            std::vector<uint8_t>& in = blocks[tail % blocks.size()].in;
+            size_t n = std::min(len - done, BLOCK_SIZE - in.size());
+            in.insert(in.end(), src + done, src + done + n);
+            done += n;
+            if (in.size() == BLOCK_SIZE) {
+                submit();
+                drain(blocks.size() - 1);
+            }
+        }
+        return done;
+    }
+
+    ssize_t seek(size_t position, int whence) override {
+        uint64_t target;
+        if (whence == SEEK_SET) {
+            target = position;
+        }
+        else if (whence == SEEK_CUR) {
+            target = tell() + position;
+        }
+        else if (whence == SEEK_END) {
+            ssize_t length = size();
+            if (length < 0 || position > (size_t)length) {
+                return -1;
+            }
+            target = length - position;
+        }
+        else {
+            return -1;
+        }
+        if (!reading) {
+            return -1;
+        }
+        // Jump with the table of blocks, unless the target is close ahead.
+        if (target < tell() || target >= end() + BLOCK_SIZE) {
+            if (!rewind(target)) {
+                return -1;
+            }
+        }
+        while (true) {
+            Block* block = current();
+            if (!block) {
+                return target == tell() ? (ssize_t)target : -1;
+            }
+            if (target < block->offset + block->out.size()) {
+                cursor = target - block->offset;
+                return target;
+            }
+            cursor = block->out.size();
+        }
+    }
+
+    bool eof() override {
+        return reading && !current();
+    }
+
+    ssize_t size() override {
+        if (!reading || !buildTable()) {
+            return -1;
+        }
+        return table.back().uoffset;
+    }
+
+    const void* view(size_t len) override {
+        Block* block = current();
+        if (!block || len > block->out.size() - cursor) {
+            return nullptr;
+        }
+        const void* ptr = block->out.data() + cursor;
+        cursor += len;
+        return ptr;
+    }
+
+private:
+    static bool IsHeader(const uint8_t* header) {
+        return header[0] == 0x1f && header[1] == 0x8b &&
+                header[2] == 0x08 && (header[3] & 0x04) &&
+                header[10] == 0x06 && header[11] == 0x00 &&
+                header[12] == 'B' && header[13] == 'C' &&
+                header[14] == 0x02 && header[15] == 0x00;
+    }
+
+    static uint32_t Load32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void Store32(uint8_t* p, uint32_t value) {
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        p[3] = value >> 24;
+    }
+
+    uint64_t tell() {
+        if (head == tail) {
+            return out_offset;
+        }
+        return blocks[head % blocks.size()].offset + cursor;
+    }
+
+    // Uncompressed offset right after the last submitted block.
+    uint64_t end() {
+        return out_offset;
+    }
+
+    // Return the block to read from, skipping consumed and empty blocks,
+    // or nullptr at the end of file.
+    Block* current() {
+        while (true) {
+            fetch();
+            if (head == tail) {
+                return nullptr;
+            }
+            Block* block = &blocks[head % blocks.size()];
+            wait(*block);
+            if (cursor < block->out.size()) {
+                return block;
+            }
+            head++;
+            cursor = 0;
+        }
+    }
+
+    // Read compressed blocks ahead and hand them to workers.
+    void fetch() {
+        while (!in_end && tail - head < blocks.size()) {
+            Block& block = blocks[tail % blocks.size()];
+            block.in.resize(HEADER_SIZE);
+            size_t len = fread(block.in.data(), 1, HEADER_SIZE, file);
+            if (len == 0 && feof(file)) {
+                in_end = true;
+                break;
+            }
+            if (len != HEADER_SIZE || !IsHeader(block.in.data())) {
+                throw std::runtime_error("broken file!");
+            }
+            size_t bsize = (block.in[16] | (block.in[17] << 8)) + 1;
+            if (bsize < HEADER_SIZE + TRAILER_SIZE) {
+                throw std::runtime_error("broken file!");
+            }
+            block.in.resize(bsize);
+            len = fread(block.in.data() + HEADER_SIZE, 1,
+                    bsize - HEADER_SIZE, file);
+            if (len != bsize - HEADER_SIZE) {
+                throw std::runtime_error("broken file!");
+            }
+            uint32_t isize = Load32(block.in.data() + bsize - 4);
+            if (isize > BLOCK_SIZE) {
+                throw std::runtime_error("broken file!");
+            }
+            block.offset = out_offset;
+            in_offset += bsize;
+            out_offset += isize;
+            submit();
+        }
+    }
+
+    void submit() {
+        std::lock_guard<std::mutex> lock(mutex);
+        blocks[tail % blocks.size()].done = false;
+        tail++;
+        work_cond.notify_one();
+    }
+
+    void wait(Block& block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!block.done) {
+            done_cond.wait(lock);
+        }
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    // Write finished blocks in order until at most <pending> are left.
+    void drain(size_t pending) {
+        while (tail - head > pending) {
+            Block& block = blocks[head % blocks.size()];
+            wait(block);
+            if (fwrite(block.out.data(), 1, block.out.size(), file) !=
+                    block.out.size()) {
+                throw std::runtime_error("Output error!");
+            }
+            block.in.clear();
+            head++;
+        }
+    }
+
+    // Drop all blocks in flight and restart reading at the block which
+    // contains <target>.
+    bool rewind(uint64_t target) {
+        if (!buildTable()) {
+            return false;
+        }
+        if (target > table.back().uoffset) {
+            return false;
+        }
+        size_t lo = 0, hi = table.size() - 1;
+        while (lo + 1 < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (table[mid].uoffset <= target) {
+                lo = mid;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        for (; head < tail; head++) {
+            wait(blocks[head % blocks.size()]);
+        }
+        if (fseeko(file, table[lo].coffset, SEEK_SET) != 0) {
+            return false;
+        }
+        cursor = 0;
+        in_offset = table[lo].coffset;
+        out_offset = table[lo].uoffset;
+        in_end = false;
+        return true;
+    }
+
+    // Build the table of block offsets by reading headers and trailers
+    // only. The last entry marks the end of file.
+    bool buildTable() {
+        if (!table.empty()) {
+            return true;
+        }
+        int fd = fileno(file);
+        uint64_t coffset = 0, uoffset = 0;
+        std::vector<Entry> entries;
+        while (true) {
+            uint8_t header[HEADER_SIZE];
+            ssize_t len = pread(fd, header, sizeof(header), coffset);
+            if (len == 0) {
+                break;
+            }
+            if (len != sizeof(header) || !IsHeader(header)) {
+                return false;
+            }
+            size_t bsize = (header[16] | (header[17] << 8)) + 1;
+            uint8_t isize[4];
+            if (pread(fd, isize, sizeof(isize), coffset + bsize - 4) !=
+                    sizeof(isize)) {
+                return false;
+            }
+            Entry entry = {coffset, uoffset};
+            entries.emplace_back(entry);
+            coffset += bsize;
+            uoffset += Load32(isize);
+        }
+        Entry entry = {coffset, uoffset};
+        entries.emplace_back(entry);
+        table.swap(entries);
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            work_cond.notify_all();
+        }
+        for (auto it = workers.begin(); it != workers.end(); it++) {
+            it->join();
+        }
+        workers.clear();
+    }
+
+    void work() {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        int ret = reading ? inflateInit2(&strm, -15) :
+                deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                Z_DEFAULT_STRATEGY);
+        bool ok = ret == Z_OK;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && next == tail) {
+                work_cond.wait(lock);
+            }
+            if (next == tail) {
+                break;
+            }
+            Block& block = blocks[next % blocks.size()];
+            next++;
+            lock.unlock();
+            const char* errmsg = nullptr;
+            if (!ok) {
+                errmsg = "zlib initialization failed!";
+            }
+            else if (reading) {
+                errmsg = decompress(strm, block);
+            }
+            else {
+                errmsg = compress(strm, block);
+            }
+            lock.lock();
+            if (errmsg && error.empty()) {
+                error = errmsg;
+            }
+            block.done = true;
+            done_cond.notify_all();
+        }
+        if (ok) {
+            reading ? inflateEnd(&strm) : deflateEnd(&strm);
+        }
+    }
+
+    static const char* compress(z_stream& strm, Block& block) {
+        size_t isize = block.in.size();
+        block.out.resize(HEADER_SIZE + deflateBound(&strm, isize) +
+                TRAILER_SIZE);
+        uint8_t* out = block.out.data();
+        if (deflateReset(&strm) != Z_OK) {
+            return "Output error!";
+        }
+        strm.next_in = block.in.data();
+        strm.avail_in = isize;
+        strm.next_out = out + HEADER_SIZE;
+        strm.avail_out = block.out.size() - HEADER_SIZE - TRAILER_SIZE;
+        if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+            return "Output error!";
+        }
+        size_t bsize = HEADER_SIZE + strm.total_out + TRAILER_SIZE;
+        if (bsize > 0x10000) {
+            return "Output error!";
+        }
+        static const uint8_t header[] = {
+            0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+        };
+        memcpy(out, header, sizeof(header));
+        out[16] = (bsize - 1) & 0xff;
+        out[17] = (bsize - 1) >> 8;
+        uint8_t* trailer = out + bsize - TRAILER_SIZE;
+        Store32(trailer, crc32(0, block.in.data(), isize));
+        Store32(trailer + 4, isize);
+        block.out.resize(bsize);
+        return nullptr;
+    }
+
+    static const char* decompress(z_stream& strm, Block& block) {
+        size_t bsize = block.in.size();
+        const uint8_t* trailer = block.in.data() + bsize - TRAILER_SIZE;
+        size_t isize = Load32(trailer + 4);
+        block.out.resize(isize);
+        if (inflateReset(&strm) != Z_OK) {
+            return "broken file!";
+        }
+        uint8_t empty;
+        strm.next_in = block.in.data() + HEADER_SIZE;
+        strm.avail_in = bsize - HEADER_SIZE - TRAILER_SIZE;
+        strm.next_out = isize ? block.out.data() : &empty;
+        strm.avail_out = isize;
+        if (inflate(&strm, Z_FINISH) != Z_STREAM_END ||
+                strm.total_out != isize ||
+                crc32(0, block.out.data(), isize) != Load32(trailer)) {
+            return "broken file!";
+        }
+        return nullptr;
+    }
+
+};
+
+template <typename T>
+class Formater {
+
+private:
+    static const size_t HEADER_SIZE = 2 * sizeof(uint32_t);
+    static const size_t MATRIX_BLOCK_SIZE = 1 << 20;
+
+    File* file;
+    std::vector<T> buffer;
+    size_t cursor;
+    size_t stride;
+    // For dense matrices only.
+    bool loaded;
+    bool written;
+    size_t rows;
+    size_t columns;
+
+public:
+    Formater(File* _file) : file(_file), cursor(0), stride(0),
+            loaded(false), written(false), rows(0), columns(0) {}
+
+    ~Formater() {
+        try {
+            finish();
+        }
+        catch (const std::exception& e) {
+        }
+    }
+
+    std::vector<T> read() {
+        size_t dim;
+        const T* ptr = view(dim);
+        return ptr ? std::vector<T>(ptr, ptr + dim) : std::vector<T>();
+    }
+
+    bool skip() {
+        size_t dim;
+        if (!next(dim)) {
+            return false;
+        }
         if (file->seek(sizeof(T) * dim, SEEK_CUR) < 0) {
             throw std::runtime_error("broken file!");
         }
         return true;
     }
 
+    // Like read(), but return a pointer to the <dim> elements of the next
+    // vector instead of a new std::vector. The pointer refers to the file
+    // mapping if the file supports view(), or to an internal buffer reused
+    // by the next call otherwise. Return nullptr at the end of file.
+    const T* view(size_t& dim) {
+        if (!next(dim)) {
+            dim = 0;
+            return nullptr;
+        }
+        const T* ptr = (const T*)file->view(sizeof(T) * dim);
+        if (ptr) {
+            return ptr;
+        }
+        buffer.resize(dim);
+        ssize_t ret = file->read(buffer.data(), sizeof(T) * dim);
+        if (ret != (ssize_t)(sizeof(T) * dim)) {
+            throw std::runtime_error("broken file!");
+        }
+        return buffer.data();
+    }
+
+    // Read at most <n> vectors of <dim> dimensions from the <begin>-th one
+    // into <dst>, and return the count actually read. A slice of a dense
+    // matrix is read in one piece.
+    size_t read(size_t begin, size_t n, size_t dim, T* dst) {
+        seek(begin);
+        if (file->isDense()) {
+            if (dim != columns) {
+                throwDimension(dim, columns);
+            }
+            n = std::min(n, rows - begin);
+            ssize_t len = sizeof(T) * dim * n;
+            if (file->read(dst, len) != len) {
+                throw std::runtime_error("broken file!");
+            }
+            cursor += n;
+            return n;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t vdim;
+            const T* vector = view(vdim);
+            if (!vector) {
+                return i;
+            }
+            if (vdim != dim) {
+                throwDimension(dim, vdim);
+            }
+            memcpy(dst + dim * i, vector, sizeof(T) * dim);
+        }
+        return n;
+    }
+
+    // Read at most <n> vectors of <dim> dimensions from the current one,
+    // convert them into TDst and store them contiguously at <dst>. Return
+    // the count actually read. A dense matrix is read and converted in big
+    // blocks, without any intermediate copy if the file is mapped or the
+    // types are the same.
+    template <typename TDst>
+    size_t readMatrix(size_t n, size_t dim, TDst* dst) {
+        vector::Converter<T, TDst> converter;
+        if (!file->isDense()) {
+            for (size_t i = 0; i < n; i++) {
+                size_t vdim;
+                const T* vector = view(vdim);
+                if (!vector) {
+                    return i;
+                }
+                if (vdim != dim) {
+                    throwDimension(dim, vdim);
+                }
+                converter(dst + dim * i, vector, dim);
+            }
+            return n;
+        }
+        loadHeader();
+        if (dim != columns) {
+            throwDimension(dim, columns);
+        }
+        n = std::min(n, rows - cursor);
+        size_t block = std::max<size_t>(1, MATRIX_BLOCK_SIZE /
+                (sizeof(T) * std::max<size_t>(1, dim)));
+        for (size_t i = 0; i < n; i += block) {
+            size_t count = std::min(block, n - i);
+            size_t len = sizeof(T) * dim * count;
+            TDst* out = dst + dim * i;
+            const T* in = (const T*)file->view(len);
+            if (!in && std::is_same<T, TDst>::value) {
+                if (file->read(out, len) != (ssize_t)len) {
+                    throw std::runtime_error("broken file!");
+                }
+                continue;
+            }
+            if (!in) {
+                buffer.resize(dim * count);
+                if (file->read(buffer.data(), len) != (ssize_t)len) {
+                    throw std::runtime_error("broken file!");
+                }
+                in = buffer.data();
+            }
+            converter(out, in, dim * count);
+        }
+        cursor += n;
+        return n;
+    }
+
     void reset() {
         file->seek(0, SEEK_SET);
+        cursor = 0;
+        loaded = false;
+    }
+
+    // Return the count of vectors, and move to the beginning. If the first,
+    // the middle and the last vectors have the same dimension which divides
+    // the size of file, all the vectors are assumed to have it, the count
+    // is derived from the size (or from the header of a dense matrix), and
+    // seek() takes O(1) time. Otherwise the file is scanned. seek() checks
+    // the dimension at its target, and scans if the assumption is wrong.
+    size_t count() {
+        reset();
+        stride = 0;
+        if (file->isDense()) {
+            loadHeader();
+            stride = sizeof(T) * columns;
+            reset();
+            return rows;
+        }
+        ssize_t length = file->size();
+        uint32_t dim;
+        if (length > 0 && file->read(&dim, sizeof(dim)) == sizeof(dim)) {
+            size_t s = sizeof(dim) + sizeof(T) * dim;
+            if (length % s == 0 &&
+                    checkDimension(length - s, dim) &&
+                    checkDimension(length / s / 2 * s, dim)) {
+                stride = s;
+            }
+        }
+        reset();
+        if (stride) {
+            return length / stride;
+        }
+        size_t n = 0;
+        while (skip()) {
+            n++;
+        }
+        reset();
+        return n;
+    }
+
+    // Move to the <index>-th vector.
+    void seek(size_t index) {
+        if (file->isDense()) {
+            loadHeader();
+            if (index > rows || file->seek(HEADER_SIZE +
+                    sizeof(T) * columns * index, SEEK_SET) < 0) {
+                throw std::runtime_error("no such vector!");
+            }
+            cursor = index;
+            return;
+        }
+        if (stride) {
+            uint32_t dim = (stride - sizeof(uint32_t)) / sizeof(T);
+            size_t offset = stride * index;
+            ssize_t length = file->size();
+            if (length < 0 || offset > (size_t)length) {
+                throw std::runtime_error("no such vector!");
+            }
+            if (offset == (size_t)length || checkDimension(offset, dim)) {
+                if (file->seek(offset, SEEK_SET) < 0) {
+                    throw std::runtime_error("broken file!");
+                }
+                cursor = index;
+                return;
+            }
+            // The dimensions vary, only not at the vectors checked.
+            stride = 0;
+            reset();
+        }
+        if (index < cursor) {
+            reset();
+        }
+        while (cursor < index) {
+            if (!skip()) {
+                throw std::runtime_error("no such vector!");
+            }
+        }
     }
 
     void write(const std::vector<T>& vector) {
-        uint32_t dim = vector.size();
-        ssize_t ret = file->write(&dim, sizeof(dim));
-        if (ret != sizeof(dim)) {
-            throw std::runtime_error("Output error!");
+        write(vector.data(), vector.size());
+    }
+
+    void write(const T* vector, size_t count) {
+        uint32_t dim = count;
+        ssize_t ret;
+        if (file->isDense()) {
+            if (!written) {
+                // The count in header is updated by finish().
+                uint32_t header[2] = {0, dim};
+                ret = file->write(header, sizeof(header));
+                if (ret != sizeof(header)) {
+                    throw std::runtime_error("Output error!");
+                }
+                written = true;
+                columns = dim;
+            }
+            else if (dim != columns) {
+                throwDimension(columns, dim);
+            }
+        }
+        else {
+            ret = file->write(&dim, sizeof(dim));
+            if (ret != sizeof(dim)) {
+                throw std::runtime_error("Output error!");
+            }
         }
-        ret = file->write(vector.data(), sizeof(T) * dim);
+        ret = file->write(vector, sizeof(T) * dim);
         if (ret != (ssize_t)sizeof(T) * dim) {
             throw std::runtime_error("Output error!");
         }
+        rows++;
+    }
+
+    // Complete the output. For a dense matrix, the count of vectors in the
+    // header is filled. Called by the destructor if not called explicitly,
+    // but then errors are ignored.
+    void finish() {
+        if (!written) {
+            return;
+        }
+        written = false;
+        uint32_t n = rows;
+        if (file->seek(0, SEEK_SET) < 0 ||
+                file->write(&n, sizeof(n)) != sizeof(n) ||
+                file->seek(0, SEEK_END) < 0) {
+            throw std::runtime_error("Output error!");
+        }
+    }
+
+private:
+    // Move to the next vector, and get its dimension.
+    bool next(size_t& dim) {
+        if (file->isDense()) {
+            loadHeader();
+            if (cursor >= rows) {
+                return false;
+            }
+            dim = columns;
+            cursor++;
+            return true;
+        }
+        uint32_t d;
+        ssize_t ret = file->read(&d, sizeof(d));
+        if (ret == 0) {
+            assert(file->eof());
+            return false;
+        }
+        if (ret != sizeof(d)) {
+            throw std::runtime_error("broken file!");
+        }
+        dim = d;
+        cursor++;
+        return true;
+    }
+
+    // Read the header of a dense matrix, if the file is at its beginning.
+    void loadHeader() {
+        if (loaded) {
+            return;
+        }
+        assert(cursor == 0);
+        uint32_t header[2];
+        ssize_t ret = file->read(header, sizeof(header));
+        if (ret == 0) {
+            rows = 0;
+            columns = 0;
+        }
+        else if (ret == sizeof(header)) {
+            rows = header[0];
+            columns = header[1];
+        }
+        else {
+            throw std::runtime_error("broken file!");
+        }
+        loaded = true;
+    }
+
+    bool checkDimension(size_t offset, uint32_t dim) {
+        uint32_t d;
+        return file->seek(offset, SEEK_SET) >= 0 &&
+                file->read(&d, sizeof(d)) == sizeof(d) && d == dim;
+    }
+
+    static void throwDimension(size_t expected, size_t actual) {
+        char buf[256];
+        sprintf(buf, "vectors should be %luD, but this one is %luD!",
+                expected, actual);
+        throw std::runtime_error(buf);
     }
 
 };
@@ -198,9 +1567,14 @@ public:
     SuffixWrapper(const char* fpath, bool rw) {
         std::string suffix(fpath);
         bool is_gz = EndsWith(suffix, ".gz");
+        bool is_bgz = EndsWith(suffix, ".bgz");
         if (is_gz) {
             suffix.resize(suffix.length() - 3);
         }
+        else if (is_bgz) {
+            suffix.resize(suffix.length() - 4);
+        }
+        bool dense = false;
         if (EndsWith(suffix, ".cvecs")) {
             type = 'c';
         }
@@ -213,12 +1587,49 @@ public:
         else if (EndsWith(suffix, ".fvecs")) {
             type = 'f';
         }
+        else if (EndsWith(suffix, ".i8bin")) {
+            type = 'c';
+            dense = true;
+        }
+        else if (EndsWith(suffix, ".u8bin")) {
+            type = 'b';
+            dense = true;
+        }
+        else if (EndsWith(suffix, ".ibin")) {
+            type = 'i';
+            dense = true;
+        }
+        else if (EndsWith(suffix, ".fbin")) {
+            type = 'f';
+            dense = true;
+        }
         else {
             throw std::runtime_error(std::string("unsupported format '")
                     .append(fpath).append("'!"));
         }
-        file = is_gz ? (File*)(new GzFile) : (File*)(new PlainFile);
+        if (dense && !rw && (is_gz || is_bgz)) {
+            // The header can not be updated after writing the vectors.
+            throw std::runtime_error(std::string("cannot write compressed "
+                    "dense matrix '").append(fpath).append("'!"));
+        }
+        if ((is_gz || is_bgz) && rw) {
+            file = BgzfFile::Detect(fpath) ? (File*)(new BgzfFile) :
+                    (File*)(new SeekableGzFile);
+        }
+        else if (is_bgz || (is_gz && UTIL_VECS_GZ_AS_BGZF)) {
+            file = new BgzfFile;
+        }
+        else if (is_gz) {
+            file = new GzFile;
+        }
+        else if (rw && IsRegularFile(fpath)) {
+            file = new MmapFile;
+        }
+        else {
+            file = new PlainFile;
+        }
         std::unique_ptr<File> file_deleter(file);
+        file->setDense(dense);
         file->open(fpath, rw);
         file_deleter.release();
     }
@@ -237,6 +1648,11 @@ public:
     }
 
 private:
+    static bool IsRegularFile(const char* fpath) {
+        struct stat st;
+        return stat(fpath, &st) == 0 && S_ISREG(st.st_mode);
+    }
+
     static bool EndsWith(const std::string& str, const std::string& suffix) {
         size_t str_len = str.length();
         size_t suffix_len = suffix.length();
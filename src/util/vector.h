@@ -8,6 +8,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "simd.h"
+
 namespace util {
 
 namespace vector {
@@ -26,7 +28,13 @@ struct Converter {
     }
 
     void operator ()(TDst* dst, const std::vector<TSrc>& src) {
-        size_t count = src.size();
+        (*this)(dst, src.data(), src.size());
+    }
+
+    // Written as a plain loop over restrict pointers, so the compiler can
+    // vectorize it.
+    void operator ()(TDst* __restrict dst, const TSrc* __restrict src,
+            size_t count) {
         for (size_t i = 0; i < count; i++) {
             dst[i] = static_cast<TDst>(src[i]);
         }
@@ -49,6 +57,10 @@ struct Converter<T, T> {
         memcpy(dst, src.data(), src.size() * sizeof(T));
     }
 
+    void operator ()(T* dst, const T* src, size_t count) {
+        memcpy(dst, src, count * sizeof(T));
+    }
+
 };
 
 template <typename TV1, typename TV2, typename TResult>
@@ -69,6 +81,10 @@ public:
         return core (v1.data(), v2.data(), dim);
     }
 
+    TResult operator ()(const TV1* v1, const TV2* v2, size_t dim) {
+        return core(v1, v2, dim);
+    }
+
 protected:
     virtual TResult core(const TV1* v1, const TV2* v2, size_t dim) = 0;
 
@@ -80,13 +96,7 @@ class DistanceL1 : public DistanceAlgo<TV1, TV2, TResult> {
 protected:
     virtual TResult core(const TV1* v1, const TV2* v2, size_t dim)
             override {
-        TResult sum = 0;
-        for (size_t i = 0; i < dim; i++) {
-            TResult delta = static_cast<TResult>(v1[i]) - 
-                    static_cast<TResult>(v2[i]);
-            sum += std::abs(delta);
-        }
-        return sum;
+        return simd::Distance<TV1, TV2, TResult>::L1(v1, v2, dim);
     }
 
 };
@@ -97,13 +107,7 @@ class DistanceL2Sqr : public DistanceAlgo<TV1, TV2, TResult> {
 protected:
     virtual TResult core(const TV1* v1, const TV2* v2, size_t dim)
             override {
-        TResult sum = 0;
-        for (size_t i = 0; i < dim; i++) {
-            TResult delta = static_cast<TResult>(v1[i]) - 
-                    static_cast<TResult>(v2[i]);
-            sum += delta * delta;
-        }
-        return sum;
+        return simd::Distance<TV1, TV2, TResult>::L2Sqr(v1, v2, dim);
     }
 
 };
@@ -114,12 +118,7 @@ class DistanceIP : public DistanceAlgo<TV1, TV2, TResult> {
 protected:
     virtual TResult core(const TV1* v1, const TV2* v2, size_t dim)
             override {
-        TResult sum = 0;
-        for (size_t i = 0; i < dim; i++) {
-            sum += static_cast<TResult>(v1[i]) * 
-                    static_cast<TResult>(v2[i]);
-        }
-        return -sum;
+        return -simd::Distance<TV1, TV2, TResult>::IP(v1, v2, dim);
     }
 
 };